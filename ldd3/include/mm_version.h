@@ -0,0 +1,17 @@
+#ifndef _MM_VERSION_H
+#define _MM_VERSION_H
+
+#include <linux/version.h>
+#include <linux/mm.h>
+
+/*
+ * vm_flags became read-only behind helpers in 6.3
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+static inline void vm_flags_set(struct vm_area_struct *vma, vm_flags_t flags)
+{
+	vma->vm_flags |= flags;
+}
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef _SHRINKER_VERSION_H
+#define _SHRINKER_VERSION_H
+
+#include <linux/version.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+
+/*
+ * Shrinkers are allocated by the core since 6.7, and had no name before 6.0
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 19, 0)
+#define SHRINK_EMPTY	0	/* nothing to free, told apart since 4.19 */
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static inline struct shrinker *compat_shrinker_register(
+        unsigned long (*count)(struct shrinker *, struct shrink_control *),
+        unsigned long (*scan)(struct shrinker *, struct shrink_control *),
+        const char *name)
+{
+	struct shrinker *s = shrinker_alloc(0, "%s", name);
+
+	if (!s)
+		return NULL;
+	s->count_objects = count;
+	s->scan_objects = scan;
+	shrinker_register(s);
+	return s;
+}
+#define compat_shrinker_unregister(s) shrinker_free(s)
+#else
+static inline struct shrinker *compat_shrinker_register(
+        unsigned long (*count)(struct shrinker *, struct shrink_control *),
+        unsigned long (*scan)(struct shrinker *, struct shrink_control *),
+        const char *name)
+{
+	struct shrinker *s = kzalloc(sizeof(*s), GFP_KERNEL);
+
+	if (!s)
+		return NULL;
+	s->count_objects = count;
+	s->scan_objects = scan;
+	s->seeks = DEFAULT_SEEKS;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	if (register_shrinker(s, "%s", name)) {
+#else
+	if (register_shrinker(s)) {
+#endif
+		kfree(s);
+		return NULL;
+	}
+	return s;
+}
+#define compat_shrinker_unregister(s)	\
+	do { unregister_shrinker(s); kfree(s); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef _SPLICE_VERSION_H
+#define _SPLICE_VERSION_H
+
+#include <linux/version.h>
+#include <linux/splice.h>
+
+/*
+ * splice_read for files that have ->read_iter but no page cache
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+#define compat_splice_read generic_file_splice_read
+#else
+#define compat_splice_read copy_splice_read
+#endif
+
+#endif
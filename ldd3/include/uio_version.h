@@ -0,0 +1,14 @@
+#ifndef _UIO_VERSION_H
+#define _UIO_VERSION_H
+
+#include <linux/version.h>
+#include <linux/uio.h>
+
+/*
+ * Iterators over user memory, the only ones worth faulting in
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+#define user_backed_iter(i)	iter_is_iovec(i)
+#endif
+
+#endif
@@ -0,0 +1,547 @@
+/*
+ * scullbench.c -- user space benchmarks for the scull devices
+ *
+ * Each benchmark is a subcommand:
+ *
+ *   scullbench pwrite [-d dev] [-t maxthreads] [-b blocksize] [-n qsets] [-i iters] [-a]
+ *      N threads pwrite() disjoint regions of one device, for N = 1, 2,
+ *      4 ... maxthreads. Each thread owns "qsets" whole quantum sets, so
+ *      threads never share a qset. With -a the device is trimmed before
+ *      every run and allocation is part of the measurement.
+ *
+ *   scullbench numa [-d dev] [-s MB] [-b blocksize] [-i iters] [-w cpu] [-r cpu] [-n maxnode]
+ *      Fill the device from CPU "w" under each placement policy (local,
+ *      interleave, and bound to each node up to maxnode), then read it
+ *      back from CPU "r" and report the read bandwidth. Pick the two CPUs
+ *      on different sockets to see what remote memory costs.
+ *
+ *   scullbench large [-d dev] [-g GiB] [-b blocksize] [-r reads] [-q quantum] [-Q qset]
+ *      Fill the device up to "GiB" gigabytes (32 by default), doubling the
+ *      size at every step, and after each step time random reads all over
+ *      what is there so far. Throughput should not depend on the size.
+ *      -q and -Q give the device its own geometry for the run; it goes
+ *      back to the module's afterwards.
+ *
+ *   scullbench folio [-d dev] [-s MB] [-b blocksize] [-i iters] [-q quantum]
+ *      Fill the device with quanta allocated one by one, then with quanta
+ *      carved from large pages (the scull_folio parameter, so this needs
+ *      root), and compare the fill time per quantum and the streaming
+ *      read bandwidth, through read() and, for page-multiple quanta,
+ *      through a mapping.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "scull.h"
+
+static const char *prog;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what)
+{
+    fprintf(stderr, "%s: %s: %s\n", prog, what, strerror(errno));
+    exit(1);
+}
+
+/* bytes in one quantum set of the device, which may have its own geometry */
+static long scull_itemsize(int fd)
+{
+    struct scull_geometry geom;
+
+    if (ioctl(fd, SCULL_IOCGGEOM, &geom) || geom.quantum <= 0 || geom.qset <= 0)
+        die("querying geometry");
+    return (long)geom.quantum * geom.qset;
+}
+
+/*
+ * pwrite scaling
+ */
+struct pwrite_job {
+    pthread_t thread;
+    pthread_barrier_t *start;
+    int fd;
+    off_t base; /* first byte of this thread's region */
+    long len; /* bytes in the region */
+    long bsize;
+    int iters;
+    char *buf;
+};
+
+static void *pwrite_thread(void *arg)
+{
+    struct pwrite_job *job = arg;
+    long off, n;
+    int i;
+
+    pthread_barrier_wait(job->start);
+    for (i = 0; i < job->iters; i++)
+        for (off = 0; off < job->len; off += n) {
+            /* the last block is cut short rather than run into the next region */
+            n = job->len - off < job->bsize ? job->len - off : job->bsize;
+            if (pwrite(job->fd, job->buf, n, job->base + off) != n)
+                die("pwrite");
+        }
+    return NULL;
+}
+
+static int bench_pwrite(int argc, char **argv)
+{
+    const char *devname = "/dev/scull0";
+    int maxthreads = 64, nqsets = 1, iters = 4, alloc = 0;
+    long bsize = 4000, itemsize, region;
+    double base = 0, t0, secs, mbs;
+    struct pwrite_job *jobs;
+    pthread_barrier_t start;
+    int fd, nthreads, i, c;
+
+    while ((c = getopt(argc, argv, "d:t:b:n:i:a")) != -1) {
+        switch (c) {
+            case 'd': devname = optarg; break;
+            case 't': maxthreads = atoi(optarg); break;
+            case 'b': bsize = atol(optarg); break;
+            case 'n': nqsets = atoi(optarg); break;
+            case 'i': iters = atoi(optarg); break;
+            case 'a': alloc = 1; break;
+            default:
+                fprintf(stderr, "usage: %s pwrite [-d dev] [-t maxthreads] "
+                        "[-b blocksize] [-n qsets] [-i iters] [-a]\n", prog);
+                return 1;
+        }
+    }
+
+    fd = open(devname, O_RDWR);
+    if (fd < 0)
+        die(devname);
+    /* regions start on qset boundaries, whatever the block size */
+    itemsize = scull_itemsize(fd);
+    region = itemsize * nqsets;
+
+    jobs = calloc(maxthreads, sizeof(*jobs));
+    if (!jobs)
+        die("calloc");
+    for (i = 0; i < maxthreads; i++) {
+        jobs[i].buf = malloc(bsize);
+        if (!jobs[i].buf)
+            die("malloc");
+        memset(jobs[i].buf, 'a' + i % 26, bsize);
+    }
+
+    printf("# %s: %ld bytes/thread (%d qsets), block %ld, %d iterations%s\n",
+           devname, region, nqsets, bsize, iters, alloc ? ", allocating" : "");
+    printf("# threads       MB/s   speedup\n");
+
+    for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+        if (alloc) {
+            /* an O_WRONLY open trims the device */
+            close(open(devname, O_WRONLY));
+        } else {
+            /* populate every region first so only the copy is timed */
+            for (off_t off = 0; off < (off_t)region * nthreads; off += bsize) {
+                long n = (off_t)region * nthreads - off < bsize ?
+                         (off_t)region * nthreads - off : bsize;
+                if (pwrite(fd, jobs[0].buf, n, off) != n)
+                    die("pwrite");
+            }
+        }
+
+        pthread_barrier_init(&start, NULL, nthreads + 1);
+        for (i = 0; i < nthreads; i++) {
+            jobs[i].start = &start;
+            jobs[i].fd = fd;
+            jobs[i].base = (off_t)region * i;
+            jobs[i].len = region;
+            jobs[i].bsize = bsize;
+            jobs[i].iters = alloc ? 1 : iters;
+            if (pthread_create(&jobs[i].thread, NULL, pwrite_thread, jobs + i))
+                die("pthread_create");
+        }
+        t0 = now();
+        pthread_barrier_wait(&start);
+        for (i = 0; i < nthreads; i++)
+            pthread_join(jobs[i].thread, NULL);
+        secs = now() - t0;
+        pthread_barrier_destroy(&start);
+
+        mbs = (double)region * nthreads * jobs[0].iters / secs / 1e6;
+        if (nthreads == 1)
+            base = mbs;
+        printf("%9d %10.1f %9.2f\n", nthreads, mbs, mbs / base);
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * read bandwidth under the NUMA placement policies
+ */
+static void pin(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set))
+        die("sched_setaffinity");
+}
+
+/* fill "size" bytes under the given policy, then time reading them back */
+static int numa_run(const char *devname, int policy, int node, long size,
+                    long bsize, int iters, int wcpu, int rcpu, char *buf)
+{
+    struct scull_numa numa = { .policy = policy, .node = node };
+    double t0, secs;
+    long off;
+    int fd, i;
+
+    /* an O_WRONLY open trims the device */
+    close(open(devname, O_WRONLY));
+    fd = open(devname, O_RDWR);
+    if (fd < 0)
+        die(devname);
+    if (ioctl(fd, SCULL_IOCSNUMA, &numa)) {
+        close(fd);
+        return -1; /* no such node */
+    }
+
+    pin(wcpu);
+    memset(buf, 'n', bsize);
+    for (off = 0; off < size; off += bsize)
+        if (pwrite(fd, buf, bsize, off) != bsize)
+            die("pwrite");
+
+    pin(rcpu);
+    t0 = now();
+    for (i = 0; i < iters; i++)
+        for (off = 0; off < size; off += bsize)
+            if (pread(fd, buf, bsize, off) != bsize)
+                die("pread");
+    secs = now() - t0;
+
+    if (policy == SCULL_NUMA_BIND)
+        printf("bind:%-9d", node);
+    else
+        printf("%-14s", policy == SCULL_NUMA_LOCAL ? "local" : "interleave");
+    printf(" %10.1f\n", (double)size * iters / secs / 1e6);
+
+    numa.policy = SCULL_NUMA_LOCAL;
+    ioctl(fd, SCULL_IOCSNUMA, &numa);
+    close(fd);
+    return 0;
+}
+
+static int bench_numa(int argc, char **argv)
+{
+    const char *devname = "/dev/scull0";
+    long size = 256, bsize = 65536;
+    int iters = 8, wcpu = 0, rcpu = 0, maxnode = 7, node, c;
+    char *buf;
+
+    while ((c = getopt(argc, argv, "d:s:b:i:w:r:n:")) != -1) {
+        switch (c) {
+            case 'd': devname = optarg; break;
+            case 's': size = atol(optarg); break;
+            case 'b': bsize = atol(optarg); break;
+            case 'i': iters = atoi(optarg); break;
+            case 'w': wcpu = atoi(optarg); break;
+            case 'r': rcpu = atoi(optarg); break;
+            case 'n': maxnode = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s numa [-d dev] [-s MB] [-b blocksize] "
+                        "[-i iters] [-w cpu] [-r cpu] [-n maxnode]\n", prog);
+                return 1;
+        }
+    }
+    size <<= 20;
+    size -= size % bsize;
+    buf = malloc(bsize);
+    if (!buf)
+        die("malloc");
+
+    printf("# %s: %ld bytes written on cpu %d, read %d times on cpu %d\n",
+           devname, size, wcpu, iters, rcpu);
+    printf("# policy          read MB/s\n");
+    numa_run(devname, SCULL_NUMA_LOCAL, -1, size, bsize, iters, wcpu, rcpu, buf);
+    numa_run(devname, SCULL_NUMA_INTERLEAVE, -1, size, bsize, iters, wcpu, rcpu, buf);
+    for (node = 0; node <= maxnode; node++)
+        numa_run(devname, SCULL_NUMA_BIND, node, size, bsize, iters, wcpu, rcpu, buf);
+
+    free(buf);
+    return 0;
+}
+
+/*
+ * large devices
+ */
+static unsigned long long xorshift64(unsigned long long *state)
+{
+    unsigned long long x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static int bench_large(int argc, char **argv)
+{
+    const char *devname = "/dev/scull0";
+    long long gib = 32, target, filled = 0, step, off, nblocks;
+    long bsize = 1 << 20, reads = 100000, i;
+    unsigned long long seed = 88172645463325252ULL;
+    int quantum = 0, qset = 0, fd, c;
+    struct scull_geometry geom = { 0 };
+    double t0, wsecs, rsecs;
+    char *buf;
+
+    while ((c = getopt(argc, argv, "d:g:b:r:q:Q:")) != -1) {
+        switch (c) {
+            case 'd': devname = optarg; break;
+            case 'g': gib = atoll(optarg); break;
+            case 'b': bsize = atol(optarg); break;
+            case 'r': reads = atol(optarg); break;
+            case 'q': quantum = atoi(optarg); break;
+            case 'Q': qset = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s large [-d dev] [-g GiB] [-b blocksize] "
+                        "[-r reads] [-q quantum] [-Q qset]\n", prog);
+                return 1;
+        }
+    }
+    target = gib << 30;
+    buf = malloc(bsize);
+    if (!buf)
+        die("malloc");
+    memset(buf, 'L', bsize);
+
+    /* an O_WRONLY open trims the device, so the geometry is free to change */
+    close(open(devname, O_WRONLY));
+    fd = open(devname, O_RDWR);
+    if (fd < 0)
+        die(devname);
+    /* this device's own, not the module-wide SCULL_IOCSQUANTUM */
+    geom.quantum = quantum;
+    geom.qset = qset;
+    if ((quantum || qset) && ioctl(fd, SCULL_IOCSGEOM, &geom))
+        die("setting the geometry");
+
+    printf("# %s: up to %lld GiB, block %ld, %ld random reads per step\n",
+           devname, gib, bsize, reads);
+    printf("#      GiB   fill MB/s   read MB/s   reads/s\n");
+
+    for (step = 1LL << 30; filled < target; step = filled) {
+        if (filled + step > target)
+            step = target - filled;
+        t0 = now();
+        for (off = filled; off < filled + step; off += bsize)
+            if (pwrite(fd, buf, bsize, off) != bsize)
+                die("pwrite");
+        wsecs = now() - t0;
+        filled += step;
+
+        nblocks = filled / bsize;
+        t0 = now();
+        for (i = 0; i < reads; i++) {
+            off = (long long)(xorshift64(&seed) % nblocks) * bsize;
+            if (pread(fd, buf, bsize, off) != bsize)
+                die("pread");
+        }
+        rsecs = now() - t0;
+
+        printf("%10.1f %11.1f %11.1f %9.0f\n", filled / (double)(1LL << 30),
+               step / wsecs / 1e6, (double)bsize * reads / rsecs / 1e6,
+               reads / rsecs);
+        fflush(stdout);
+    }
+
+    close(fd);
+    free(buf);
+    if (quantum || qset) {
+        /* leave the module's default geometry behind */
+        close(open(devname, O_WRONLY));
+        fd = open(devname, O_RDWR);
+        if (fd >= 0) {
+            geom.quantum = 0;
+            geom.qset = 0;
+            ioctl(fd, SCULL_IOCSGEOM, &geom);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+/*
+ * carved quanta
+ */
+#define FOLIO_PARAM "/sys/module/scull/parameters/scull_folio"
+
+/* set scull_folio, returning the old value, or -1 if it can't be done */
+static int set_folio(int on)
+{
+    char old = '0', val = on ? '1' : '0';
+    int fd = open(FOLIO_PARAM, O_RDWR);
+
+    if (fd < 0)
+        return -1;
+    if (read(fd, &old, 1) != 1 || pwrite(fd, &val, 1, 0) != 1) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return old == '1';
+}
+
+static void folio_run(const char *devname, int on, int quantum, long size,
+                      long bsize, int iters, char *buf)
+{
+    struct scull_geometry geom = { .quantum = quantum };
+    double t0, fill, secs, msecs = 0;
+    volatile unsigned long sum = 0;
+    unsigned long *map;
+    long off, i;
+    int fd, it;
+
+    /* an O_WRONLY open trims the device, so the geometry is free to change */
+    close(open(devname, O_WRONLY));
+    fd = open(devname, O_RDWR);
+    if (fd < 0)
+        die(devname);
+    if (quantum && ioctl(fd, SCULL_IOCSGEOM, &geom))
+        die("setting the geometry");
+    if (ioctl(fd, SCULL_IOCGGEOM, &geom))
+        die("querying the geometry");
+
+    memset(buf, 'f', bsize);
+    t0 = now();
+    for (off = 0; off < size; off += bsize)
+        if (pwrite(fd, buf, bsize, off) != bsize)
+            die("pwrite");
+    fill = now() - t0;
+
+    t0 = now();
+    for (it = 0; it < iters; it++)
+        for (off = 0; off < size; off += bsize)
+            if (pread(fd, buf, bsize, off) != bsize)
+                die("pread");
+    secs = now() - t0;
+
+    if (!(geom.quantum % sysconf(_SC_PAGESIZE))) {
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+            die("mmap");
+        t0 = now();
+        for (it = 0; it < iters; it++)
+            for (i = 0; i < size / (long)sizeof(*map); i++)
+                sum += map[i];
+        msecs = now() - t0;
+        munmap(map, size);
+    }
+
+    printf("%-8s %9d %10.1f %11.0f %10.1f", on ? "carved" : "quantum",
+           geom.quantum, size / fill / 1e6, fill * 1e9 / (size / geom.quantum),
+           (double)size * iters / secs / 1e6);
+    if (msecs)
+        printf(" %10.1f\n", (double)size * iters / msecs / 1e6);
+    else
+        printf(" %10s\n", "-");
+
+    close(fd);
+    if (!quantum)
+        return;
+    /* leave the module's default geometry behind */
+    close(open(devname, O_WRONLY));
+    fd = open(devname, O_RDWR);
+    if (fd >= 0) {
+        geom.quantum = 0;
+        geom.qset = 0;
+        geom.flags = 0;
+        ioctl(fd, SCULL_IOCSGEOM, &geom);
+        close(fd);
+    }
+}
+
+static int bench_folio(int argc, char **argv)
+{
+    const char *devname = "/dev/scull0";
+    long size = 512, bsize = 1 << 20;
+    int iters = 4, quantum = 0, old, c;
+    char *buf;
+
+    while ((c = getopt(argc, argv, "d:s:b:i:q:")) != -1) {
+        switch (c) {
+            case 'd': devname = optarg; break;
+            case 's': size = atol(optarg); break;
+            case 'b': bsize = atol(optarg); break;
+            case 'i': iters = atoi(optarg); break;
+            case 'q': quantum = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s folio [-d dev] [-s MB] [-b blocksize] "
+                        "[-i iters] [-q quantum]\n", prog);
+                return 1;
+        }
+    }
+    size <<= 20;
+    size -= size % bsize;
+    buf = malloc(bsize);
+    if (!buf)
+        die("malloc");
+    old = set_folio(0);
+    if (old < 0)
+        die(FOLIO_PARAM);
+
+    printf("# %s: %ld bytes in blocks of %ld, read %d times\n",
+           devname, size, bsize, iters);
+    printf("# layout   quantum  fill MB/s  ns/quantum  read MB/s  mmap MB/s\n");
+    folio_run(devname, 0, quantum, size, bsize, iters, buf);
+    set_folio(1);
+    folio_run(devname, 1, quantum, size, bsize, iters, buf);
+
+    set_folio(old);
+    free(buf);
+    return 0;
+}
+
+static struct {
+    const char *name;
+    int (*run)(int argc, char **argv);
+} benches[] = {
+    { "pwrite", bench_pwrite },
+    { "numa", bench_numa },
+    { "large", bench_large },
+    { "folio", bench_folio },
+};
+
+int main(int argc, char **argv)
+{
+    unsigned int i;
+
+    prog = argv[0];
+    if (argc > 1)
+        for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+            if (!strcmp(argv[1], benches[i].name))
+                return benches[i].run(argc - 1, argv + 1);
+
+    fprintf(stderr, "usage: %s <benchmark> [options]\nbenchmarks:", prog);
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+        fprintf(stderr, " %s", benches[i].name);
+    fprintf(stderr, "\n");
+    return 1;
+}
@@ -120,7 +120,16 @@ static void scull_access_setup(dev_t devno, struct scull_adev_info *devinfo)
     /* intialise the device structure */
     dev->quantum = scull_quantum;
     dev->qset = scull_qset;
-    mutex_init(&dev->lock);
+    init_rwsem(&dev->rwsem);
+    dev->qsets = scull_qsets_alloc();
+    if (!dev->qsets) {
+        printk(KERN_NOTICE "Error allocating %s\n", devinfo->name);
+        return;
+    }
+    if (scull_stats_init(&dev->stats, devinfo->name)) {
+        printk(KERN_NOTICE "Error allocating statistics for %s\n", devinfo->name);
+        return;
+    }
 
     /* cdev things */
     cdev_init(&dev->cdev, devinfo->fops);
@@ -163,13 +172,14 @@ void scull_access_cleanup(void)
     for (i = 0; i < SCULL_N_ADEVS; i++) {
         struct scull_dev *dev = scull_access_devs[i].sculldev;
         cdev_del(&dev->cdev);
-        scull_trim(scull_access_devs[i].sculldev);
+        scull_qsets_free(scull_access_devs[i].sculldev);
+        scull_stats_cleanup(&dev->stats);
     }
 
     /* all the cloned devices */
     list_for_each_entry_safe(lptr, next, &scull_c_list, list) {
         list_del(&lptr->list);
-        scull_trim(&(lptr->device));
+        scull_qsets_free(&(lptr->device));
         kfree(lptr);
     }
 
@@ -0,0 +1,129 @@
+/*
+ * adapt.c -- a quantum to fit the writes
+ *
+ * With scull_adaptive set, a bare device without a geometry of its own
+ * (SCULL_IOCSGEOM) picks its quantum whenever it is emptied, from the
+ * writes it has seen since the last time:
+ *
+ *  - the typical write is the size class that carries the median byte,
+ *    that is the power of two it rounds up to;
+ *  - if most writes carried on where the previous one ended, the device
+ *    is being streamed into: the quantum grows towards the larger of
+ *    the typical write and 1/64th of the last fill, by at most four
+ *    times per fill, so one odd run doesn't settle it;
+ *  - otherwise the quantum is just the typical write, however small,
+ *    so that sparse writes don't drag whole quanta of zeroes along.
+ *
+ * The quantum stays between SCULL_ADAPT_MIN and scull_adapt_max, and is
+ * a power of two, so from a page up it is page-backed. The qset doesn't
+ * change. The choice applies to the whole device rather than to each
+ * qset: the offset of every byte depends on one geometry, and a device
+ * is normally refilled as a whole anyway (an O_WRONLY open trims it).
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+
+#include "scull.h"
+
+#define SCULL_ADAPT_MIN 128
+#define SCULL_ADAPT_WRITES 16 /* fewer writes than that say nothing */
+#define SCULL_ADAPT_GROWTH 4
+
+int scull_adaptive = 0;
+static int scull_adapt_max = 1 << 20;
+
+module_param(scull_adaptive, int, S_IRUGO);
+module_param(scull_adapt_max, int, S_IRUGO | S_IWUSR);
+
+/*
+** Pick the quantum for dev, which is being trimmed; dev->size is still
+** that of the fill that is going away. Called with the write lock held.
+*/
+int scull_adapt_quantum(struct scull_dev *dev)
+{
+    struct scull_adapt *ad = &dev->adapt;
+    struct scull_stats_cpu *c;
+    u64 hist[SCULL_LAT_BUCKETS] = { 0 };
+    u64 writes = 0, seq = 0, bytes = 0, half;
+    unsigned long want, typical;
+    int quantum = dev->quantum, limit, cpu, i;
+
+    for_each_possible_cpu(cpu) {
+        c = per_cpu_ptr(dev->stats.cpu, cpu);
+        writes += c->writes;
+        seq += c->seq_writes;
+        for (i = 0; i < SCULL_LAT_BUCKETS; i++)
+            hist[i] += c->write_size[i];
+    }
+    swap(writes, ad->writes);
+    swap(seq, ad->seq_writes);
+    writes = ad->writes - writes;
+    seq = ad->seq_writes - seq;
+    for (i = 0; i < SCULL_LAT_BUCKETS; i++) {
+        swap(hist[i], ad->write_size[i]);
+        hist[i] = ad->write_size[i] - hist[i];
+        bytes += hist[i] << i;
+    }
+    if (writes < SCULL_ADAPT_WRITES || !bytes)
+        return quantum;
+
+    /* the size class half the bytes were written in */
+    half = bytes / 2;
+    for (i = 0; i < SCULL_LAT_BUCKETS - 1; i++) {
+        if ((hist[i] << i) >= half)
+            break;
+        half -= hist[i] << i;
+    }
+    limit = rounddown_pow_of_two(clamp(READ_ONCE(scull_adapt_max),
+                                       SCULL_ADAPT_MIN, (int)KMALLOC_MAX_SIZE));
+    typical = min_t(u64, 1ULL << i, limit); /* bucket i holds up to 2^i */
+    ad->typical = typical;
+    ad->seq_pct = div64_u64(seq * 100, writes);
+
+    if (ad->seq_pct >= 75) {
+        want = max_t(unsigned long, typical, dev->size / 64);
+        want = min_t(unsigned long, want,
+                     (unsigned long)roundup_pow_of_two(quantum) * SCULL_ADAPT_GROWTH);
+    } else {
+        want = typical;
+    }
+    want = roundup_pow_of_two(clamp_t(unsigned long, want, SCULL_ADAPT_MIN, limit));
+    if (want != quantum)
+        ad->changes++;
+    return want;
+}
+
+/*
+** The geometry and, for the stats file, how well the quanta are used:
+** what the device is charged for less what writes filled (see
+** scull_note_fill). Both are kept as the data changes, so this costs
+** nothing. It is an estimate: stores through mappings aren't seen and
+** count as unused, a second write into a gap below the end passes for
+** an overwrite, and punched quanta aren't taken back off what was
+** filled.
+*/
+void scull_adapt_show(struct seq_file *s, struct scull_stats *st)
+{
+    struct scull_dev *dev = container_of(st, struct scull_dev, stats);
+    struct scull_adapt *ad = &dev->adapt;
+    long held = atomic_long_read(&st->charged);
+    long filled = atomic_long_read(&st->filled);
+    u64 unused = held > filled ? held - filled : 0;
+
+    down_read(&dev->rwsem);
+    seq_printf(s, "quantum: %d\n", dev->quantum);
+    seq_printf(s, "qset: %d\n", dev->qset);
+    if (dev->adaptive) {
+        seq_printf(s, "adapt_typical_write: %d\n", ad->typical);
+        seq_printf(s, "adapt_sequential_pct: %d\n", ad->seq_pct);
+        seq_printf(s, "adapt_changes: %lu\n", ad->changes);
+    }
+    up_read(&dev->rwsem);
+
+    seq_printf(s, "frag_bytes: %llu\n", unused);
+    seq_printf(s, "frag_pct: %llu\n", held > 0 ? div64_u64(unused * 100, held) : 0);
+}
@@ -0,0 +1,533 @@
+/*
+ * alloc.c -- memory for the scull devices
+ *
+ * Quantum sets, their pointer arrays and kmalloc-sized quanta come from
+ * dedicated slab caches, sized for the geometry the module was loaded
+ * with. Devices that have since been switched to another geometry fall
+ * back to the general allocator. Page-multiple quanta always come from
+ * the page allocator, so that they can be mmap()ed.
+ *
+ * On top of that each device can keep a reserve of ready-made quanta
+ * (scull_pool_quanta), topped up by a work item, so a burst of writes
+ * to fresh space mostly skips the allocator altogether.
+ *
+ * With scull_folio set, the quanta of a bare device are instead cut out
+ * of large pages, see scull_carve_quantum.
+ *
+ * Quanta can also be shared between slots, see struct scull_shared.
+ *
+ * Everything a write allocates is charged to the writer's memory cgroup.
+ * Quanta in the pools are allocated by a worker, and are only charged
+ * to the cgroup of whoever made the device.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/refcount.h>
+#include <linux/srcu.h>
+
+#include "scull.h"
+
+static struct kmem_cache *scull_qset_cache;
+static struct kmem_cache *scull_array_cache;
+static struct kmem_cache *scull_quantum_cache;
+static int scull_array_cache_qset; /* items per array in scull_array_cache */
+static int scull_quantum_cache_size; /* object size of scull_quantum_cache */
+
+atomic_long_t scull_mem_used; /* bytes of quanta allocated, for budget.c */
+atomic_long_t scull_node_used[MAX_NUMNODES]; /* ... on each node, for numa.c */
+
+/* data, a quantum, has just been allocated (bytes > 0) or is going */
+static void scull_mem_account(void *data, long bytes)
+{
+    atomic_long_add(bytes, &scull_mem_used);
+    atomic_long_add(bytes, &scull_node_used[page_to_nid(virt_to_page(data))]);
+}
+
+int scull_folio = 0; /* carve quanta from large pages */
+
+module_param(scull_folio, int, S_IRUGO | S_IWUSR);
+
+/*
+** Quantum sets
+*/
+struct scull_qset *scull_alloc_qset(void)
+{
+    struct scull_qset *qs = kmem_cache_zalloc(scull_qset_cache, GFP_KERNEL);
+
+    if (qs) {
+        mutex_init(&qs->lock);
+        qs->touched = jiffies;
+    }
+    return qs;
+}
+
+void scull_free_qset(struct scull_qset *qs)
+{
+    kmem_cache_free(scull_qset_cache, qs);
+}
+
+/*
+** Pointer arrays, "qset" entries long
+*/
+void **scull_alloc_array(int qset)
+{
+    if (scull_array_cache && qset == scull_array_cache_qset)
+        return kmem_cache_zalloc(scull_array_cache, GFP_KERNEL);
+    return kcalloc(qset, sizeof(void *), GFP_KERNEL_ACCOUNT);
+}
+
+void scull_free_array(int qset, void **data)
+{
+    if (!data)
+        return;
+    if (scull_array_cache && qset == scull_array_cache_qset)
+        kmem_cache_free(scull_array_cache, data);
+    else
+        kfree(data);
+}
+
+/*
+** Quanta
+*/
+/*
+** On "node", or the local one for NUMA_NO_NODE (see numa.c). Quanta come
+** zeroed, whatever they are made of: a write into the middle of a fresh
+** one leaves the rest of it readable, and that has to read as a hole.
+*/
+void *scull_alloc_quantum_node(int quantum, int node)
+{
+    struct page *page;
+    void *data;
+
+    if (scull_quantum_paged(quantum)) {
+        page = alloc_pages_node(node, GFP_KERNEL_ACCOUNT | __GFP_ZERO |
+                                __GFP_COMP, get_order(quantum));
+        data = page ? page_address(page) : NULL;
+    } else if (scull_quantum_cache && quantum == scull_quantum_cache_size) {
+        data = kmem_cache_alloc_node(scull_quantum_cache,
+                                     GFP_KERNEL | __GFP_ZERO, node);
+    } else {
+        data = kzalloc_node(quantum, GFP_KERNEL_ACCOUNT, node);
+    }
+    if (data)
+        scull_mem_account(data, quantum);
+    return data;
+}
+
+void *scull_alloc_quantum(int quantum)
+{
+    return scull_alloc_quantum_node(quantum, NUMA_NO_NODE);
+}
+
+/*
+** Carving. A device in scull_folio mode cuts its quanta, one after the
+** other, out of a compound page of SCULL_FOLIO_ORDER (2MB on x86, a
+** PMD's worth) or, if the page allocator has none, of
+** PAGE_ALLOC_COSTLY_ORDER; failing both, quanta are allocated one by one
+** as usual. A device's data then sits in a few large contiguous blocks
+** instead of all over memory, and a fill costs one allocation per large
+** page rather than per quantum.
+**
+** Every quantum holds a reference to its page, which goes back to the
+** allocator with the last of them. One long-lived quantum thus keeps a
+** whole large page: carving is for bulk devices, filled and trimmed as
+** a whole. Page-multiple quanta stay page aligned, so they can still be
+** mapped. A carved quantum is recognised by its page, which is larger
+** than the quantum needs; only carving makes such pages.
+*/
+#define SCULL_FOLIO_ORDER (PMD_SHIFT - PAGE_SHIFT)
+
+static unsigned int scull_carve_size(int quantum)
+{
+    return scull_quantum_paged(quantum) ? quantum : ALIGN(quantum, L1_CACHE_BYTES);
+}
+
+static int scull_quantum_carved(int quantum, void *data)
+{
+    struct page *head = virt_to_head_page(data);
+
+    return !PageSlab(head) && compound_order(head) > get_order(quantum);
+}
+
+/* cut "size" bytes off the current page, NULL if it has no room left */
+static void *scull_carve_cut(struct scull_carve *carve, unsigned int size)
+{
+    void *data;
+
+    if (!carve->page || carve->off + size > page_size(carve->page))
+        return NULL;
+    data = page_address(carve->page) + carve->off;
+    carve->off += size;
+    get_page(carve->page);
+    return data;
+}
+
+/* a new page to carve quanta of the given size from, at least two of them */
+static struct page *scull_carve_page(struct scull_dev *dev, int quantum)
+{
+    gfp_t gfp = GFP_KERNEL_ACCOUNT | __GFP_COMP | __GFP_ZERO |
+                __GFP_NOWARN | __GFP_NORETRY;
+    int min_order = get_order(quantum) + 1;
+    struct page *page = NULL;
+
+    if (SCULL_FOLIO_ORDER >= min_order) {
+        page = alloc_pages(gfp, SCULL_FOLIO_ORDER);
+        if (!page)
+            scull_stat_inc(&dev->stats, folio_fallbacks);
+    }
+    if (!page && PAGE_ALLOC_COSTLY_ORDER >= min_order &&
+        PAGE_ALLOC_COSTLY_ORDER < SCULL_FOLIO_ORDER)
+        page = alloc_pages(gfp, PAGE_ALLOC_COSTLY_ORDER);
+    if (page)
+        scull_stat_inc(&dev->stats, folios);
+    return page;
+}
+
+/*
+** Return a zeroed quantum cut from dev's current large page, taking a
+** new page when that one is used up. NULL if carving is off, or no
+** large page could be had; the caller then allocates the usual way.
+*/
+void *scull_carve_quantum(struct scull_dev *dev, int quantum)
+{
+    struct scull_carve *carve = &dev->carve;
+    unsigned int size = scull_carve_size(quantum);
+    struct page *page, *old = NULL;
+    void *data;
+
+    if (!READ_ONCE(scull_folio))
+        return NULL;
+
+    spin_lock(&carve->lock);
+    data = scull_carve_cut(carve, size);
+    spin_unlock(&carve->lock);
+    if (!data) {
+        page = scull_carve_page(dev, quantum);
+        if (!page)
+            return NULL;
+        spin_lock(&carve->lock);
+        data = scull_carve_cut(carve, size); /* another writer got one first */
+        if (!data) {
+            old = carve->page;
+            carve->page = page;
+            carve->off = 0;
+            page = NULL;
+            data = scull_carve_cut(carve, size);
+        }
+        spin_unlock(&carve->lock);
+        if (page)
+            put_page(page);
+        if (old)
+            put_page(old); /* its quanta keep it alive */
+    }
+    scull_mem_account(data, quantum);
+    return data;
+}
+
+void scull_carve_init(struct scull_carve *carve)
+{
+    spin_lock_init(&carve->lock);
+    carve->page = NULL;
+    carve->off = 0;
+}
+
+void scull_carve_cleanup(struct scull_carve *carve)
+{
+    if (carve->page)
+        put_page(carve->page);
+    carve->page = NULL;
+}
+
+/*
+** Mapped pages hold their own reference, so freeing a paged quantum
+** only drops ours and the memory goes away once the last user unmaps it.
+*/
+void scull_free_quantum(int quantum, void *data)
+{
+    if (!data)
+        return;
+    scull_mem_account(data, -quantum);
+    if (scull_quantum_carved(quantum, data))
+        put_page(virt_to_page(data));
+    else if (scull_quantum_paged(quantum))
+        free_pages((unsigned long)data, get_order(quantum));
+    else if (scull_quantum_cache && quantum == scull_quantum_cache_size)
+        kmem_cache_free(scull_quantum_cache, data);
+    else
+        kfree(data);
+}
+
+/*
+** Shared quanta
+*/
+DEFINE_SRCU(scull_srcu);
+
+static void scull_shared_free(struct rcu_head *rcu)
+{
+    struct scull_shared *sh = container_of(rcu, struct scull_shared, rcu);
+
+    scull_dedup_forget(sh);
+    scull_free_quantum(sh->quantum, sh->data);
+    kfree(sh);
+}
+
+/* the data lives on in a slot, only the descriptor goes */
+static void scull_shared_free_desc(struct rcu_head *rcu)
+{
+    kfree(container_of(rcu, struct scull_shared, rcu));
+}
+
+/* let go of the quantum in a slot; shared ones only lose a reference */
+void scull_put_quantum(int quantum, void *q)
+{
+    struct scull_shared *sh;
+
+    if (!q || scull_q_is_zero(q))
+        return;
+    if (scull_q_is_packed(q)) {
+        kfree(scull_q_packed(q));
+        return;
+    }
+    if (!scull_q_is_shared(q)) {
+        scull_free_quantum(quantum, q);
+        return;
+    }
+    sh = scull_q_shared(q);
+    if (refcount_dec_and_test(&sh->ref))
+        call_srcu(&scull_srcu, &sh->rcu, scull_shared_free);
+}
+
+/*
+** Turn the quantum in *slot into a shared one if it isn't already, and
+** return a new reference to it for another slot. The caller keeps the
+** slot from changing under us.
+*/
+void *scull_share_quantum(int quantum, void **slot)
+{
+    struct scull_shared *sh;
+    void *q = *slot;
+
+    if (!scull_q_is_shared(q)) {
+        sh = kmalloc(sizeof(*sh), GFP_KERNEL_ACCOUNT);
+        if (!sh)
+            return NULL;
+        refcount_set(&sh->ref, 1);
+        sh->quantum = quantum;
+        sh->data = q;
+        INIT_HLIST_NODE(&sh->hnode);
+        q = (void *)((unsigned long)sh | SCULL_Q_SHARED);
+        smp_store_release(slot, q);
+    }
+    refcount_inc(&scull_q_shared(q)->ref);
+    return q;
+}
+
+/*
+** Make the quantum in *slot private before it is written to, and return
+** its data. A quantum nobody else refers to any more is simply taken
+** back; otherwise it is copied. Called with the slot's qset locked.
+*/
+void *scull_unshare_quantum(int quantum, void **slot)
+{
+    struct scull_shared *sh;
+    void *q = *slot;
+    void *data;
+
+    if (!scull_q_is_shared(q))
+        return q;
+    sh = scull_q_shared(q);
+
+    /* only this slot holds it, and the slot is ours */
+    if (scull_dedup_claim(sh)) {
+        data = sh->data;
+        smp_store_release(slot, data);
+        call_srcu(&scull_srcu, &sh->rcu, scull_shared_free_desc);
+        return data;
+    }
+
+    data = scull_alloc_quantum(quantum);
+    if (!data)
+        return NULL;
+    memcpy(data, sh->data, quantum);
+    smp_store_release(slot, data);
+    scull_put_quantum(quantum, q);
+    return data;
+}
+
+/*
+** The reserve pool. Free quanta are chained through their first word;
+** the word is cleared again when a quantum is handed out, so paged
+** quanta are still all zeroes when they reach the device.
+*/
+static void scull_pool_free_list(void *head, int quantum)
+{
+    void *next;
+
+    while (head) {
+        next = *(void **)head;
+        scull_free_quantum(quantum, head);
+        head = next;
+    }
+}
+
+static void scull_pool_refill(struct work_struct *work)
+{
+    struct scull_pool *pool = container_of(work, struct scull_pool, refill);
+    void *stale = NULL, *data;
+    int quantum, stale_quantum = 0;
+
+    /* the device changed geometry: what we hold is the wrong size */
+    spin_lock(&pool->lock);
+    if (pool->quantum != pool->want) {
+        stale = pool->head;
+        stale_quantum = pool->quantum;
+        pool->head = NULL;
+        pool->nr = 0;
+        pool->quantum = pool->want;
+    }
+    quantum = pool->quantum;
+    spin_unlock(&pool->lock);
+    scull_pool_free_list(stale, stale_quantum);
+
+    if (quantum < sizeof(void *))
+        return;
+
+    while (READ_ONCE(pool->nr) < pool->target) {
+        data = scull_alloc_quantum(quantum);
+        if (!data)
+            break;
+        spin_lock(&pool->lock);
+        if (pool->quantum != quantum || pool->nr >= pool->target) {
+            spin_unlock(&pool->lock);
+            scull_free_quantum(quantum, data);
+            break; /* a later scull_pool_get requeues us if needed */
+        }
+        *(void **)data = pool->head;
+        pool->head = data;
+        pool->nr++;
+        spin_unlock(&pool->lock);
+    }
+}
+
+/*
+** Take a quantum of the given size from the pool, or return NULL if
+** there is none and the caller has to allocate it. Runs with the qset
+** mutex held, so it never blocks.
+*/
+void *scull_pool_get(struct scull_pool *pool, int quantum)
+{
+    void *data = NULL;
+    int low;
+
+    if (!pool->target)
+        return NULL;
+
+    spin_lock(&pool->lock);
+    if (pool->quantum == quantum && pool->head) {
+        data = pool->head;
+        pool->head = *(void **)data;
+        pool->nr--;
+    }
+    pool->want = quantum;
+    low = pool->nr <= pool->target / 2;
+    spin_unlock(&pool->lock);
+
+    if (data)
+        *(void **)data = NULL; /* the rest is still zero */
+    if (low)
+        schedule_work(&pool->refill);
+    return data;
+}
+
+/* give back up to nr quanta under memory pressure, returns how many */
+unsigned long scull_pool_shrink(struct scull_pool *pool, unsigned long nr)
+{
+    unsigned long freed = 0;
+    void *head = NULL, *data;
+    int quantum;
+
+    spin_lock(&pool->lock);
+    quantum = pool->quantum;
+    while (pool->head && freed < nr) {
+        data = pool->head;
+        pool->head = *(void **)data;
+        pool->nr--;
+        *(void **)data = head;
+        head = data;
+        freed++;
+    }
+    spin_unlock(&pool->lock);
+    scull_pool_free_list(head, quantum);
+    return freed;
+}
+
+/* set up a pool of "target" quanta (0 disables it) and start filling it */
+void scull_pool_init(struct scull_pool *pool, int quantum, int target)
+{
+    spin_lock_init(&pool->lock);
+    INIT_WORK(&pool->refill, scull_pool_refill);
+    pool->head = NULL;
+    pool->nr = 0;
+    pool->quantum = pool->want = quantum;
+    pool->target = max(target, 0);
+    if (pool->target)
+        schedule_work(&pool->refill);
+}
+
+void scull_pool_cleanup(struct scull_pool *pool)
+{
+    if (!pool->target)
+        return;
+    cancel_work_sync(&pool->refill);
+    scull_pool_free_list(pool->head, pool->quantum);
+    pool->head = NULL;
+    pool->nr = 0;
+}
+
+/*
+** The caches are sized for the geometry given at load time. A quantum
+** cache is only made for kmalloc-sized quanta; it has to be whitelisted
+** for copy_{to,from}_user, which move data straight in and out of it.
+*/
+int scull_alloc_init(void)
+{
+    scull_qset_cache = KMEM_CACHE(scull_qset, SLAB_ACCOUNT);
+    if (!scull_qset_cache)
+        goto fail;
+
+    scull_array_cache_qset = scull_qset;
+    scull_array_cache = kmem_cache_create("scull_array",
+                                          scull_qset * sizeof(void *), 0,
+                                          SLAB_ACCOUNT, NULL);
+    if (!scull_array_cache)
+        goto fail;
+
+    if (!scull_quantum_paged(scull_quantum)) {
+        scull_quantum_cache_size = scull_quantum;
+        scull_quantum_cache = kmem_cache_create_usercopy("scull_quantum",
+                                    scull_quantum, 0, SLAB_ACCOUNT, 0,
+                                    scull_quantum, NULL);
+        if (!scull_quantum_cache)
+            goto fail;
+    }
+    return 0;
+
+    fail:
+        scull_alloc_cleanup();
+        return -ENOMEM;
+}
+
+void scull_alloc_cleanup(void)
+{
+    kmem_cache_destroy(scull_quantum_cache);
+    kmem_cache_destroy(scull_array_cache);
+    kmem_cache_destroy(scull_qset_cache);
+    scull_quantum_cache = NULL;
+    scull_array_cache = NULL;
+    scull_qset_cache = NULL;
+}
@@ -0,0 +1,99 @@
+/*
+ * budget.c -- memory budgets and the shrinker
+ *
+ * Each bare device is charged for every quantum its slots hold, shared
+ * or compressed ones included (zero markers and holes are free), and
+ * may be given a budget in bytes: a write that would take it over the
+ * budget fails with ENOSPC instead. scull_mem_budget does the same for
+ * the memory all of scull has allocated for quanta. Either way nothing
+ * is reclaimed to make room; scull data can't be paged out, so a full
+ * device is better than a thrashing box.
+ *
+ * Under memory pressure the shrinker gives back what isn't data: the
+ * reserve pools. It also asks the compressor to pack anything that has
+ * been idle for a second, rather than the configured scull_compress_secs.
+ * Only memory that is really on its way out is counted, though: the
+ * pools, and the sets of trimmed devices still waiting to be freed.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/atomic.h>
+
+#include "scull.h"
+#include "shrinker_version.h"
+
+unsigned long scull_dev_budget = 0; /* default per-device budget, 0 = none */
+static unsigned long scull_mem_budget = 0; /* for all of scull, 0 = none */
+
+module_param(scull_dev_budget, ulong, S_IRUGO);
+module_param(scull_mem_budget, ulong, S_IRUGO | S_IWUSR);
+
+static struct shrinker *scull_shrinker;
+
+/*
+** Charge "bytes" of new quanta to dev, before they are allocated.
+** Returns -ENOSPC if that would go over either budget.
+*/
+int scull_charge(struct scull_dev *dev, long bytes)
+{
+    unsigned long budget = READ_ONCE(dev->budget);
+    unsigned long global = READ_ONCE(scull_mem_budget);
+    long charged = atomic_long_add_return(bytes, &dev->stats.charged);
+
+    if ((budget && charged > budget) ||
+        (global && atomic_long_read(&scull_mem_used) + bytes > global)) {
+        atomic_long_sub(bytes, &dev->stats.charged);
+        return -ENOSPC;
+    }
+    return 0;
+}
+
+void scull_uncharge(struct scull_dev *dev, long bytes)
+{
+    atomic_long_sub(bytes, &dev->stats.charged);
+}
+
+static unsigned long scull_shrink_count(struct shrinker *s,
+                                        struct shrink_control *sc)
+{
+    unsigned long count = 0;
+    int i;
+
+    for (i = 0; i < scull_nr_devs; i++)
+        count += READ_ONCE(scull_devices[i].pool.nr);
+    /* freed by scull_trim_wq anyway, but it is coming back */
+    count += max(atomic_long_read(&scull_trim_backlog), 0L);
+    return count ? count : SHRINK_EMPTY;
+}
+
+static unsigned long scull_shrink_scan(struct shrinker *s,
+                                       struct shrink_control *sc)
+{
+    unsigned long freed = 0;
+    int i;
+
+    for (i = 0; i < scull_nr_devs && freed < sc->nr_to_scan; i++)
+        freed += scull_pool_shrink(&scull_devices[i].pool,
+                                   sc->nr_to_scan - freed);
+    for (i = 0; i < scull_nr_devs; i++)
+        scull_compress_kick(scull_devices + i);
+    return freed ? freed : SHRINK_STOP;
+}
+
+/* without a shrinker scull just doesn't help out under pressure */
+void scull_budget_init(void)
+{
+    scull_shrinker = compat_shrinker_register(scull_shrink_count,
+                                              scull_shrink_scan, "scull");
+    if (!scull_shrinker)
+        printk(KERN_WARNING "scull: can't register the shrinker\n");
+}
+
+void scull_budget_cleanup(void)
+{
+    if (scull_shrinker)
+        compat_shrinker_unregister(scull_shrinker);
+    scull_shrinker = NULL;
+}
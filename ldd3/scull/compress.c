@@ -0,0 +1,262 @@
+/*
+ * compress.c -- transparent compression of cold quanta
+ *
+ * With scull_compress_secs set, every bare device runs a delayed work
+ * item that looks for quantum sets nobody has read or written for that
+ * long and compresses their quanta with the crypto API compressor named
+ * by scull_compress_alg. A compressed quantum sits in its slot as a
+ * tagged pointer to a struct scull_packed, and is decompressed again the
+ * first time anybody touches it. Quanta that are shared, mapped, or
+ * that don't shrink by at least a quarter are left alone.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/jiffies.h>
+#include <linux/scatterlist.h>
+#include <linux/overflow.h>
+#include <linux/workqueue.h>
+#include <crypto/acompress.h>
+
+#include "scull.h"
+
+int scull_compress_secs = 0; /* idle time before a qset is compressed, 0 = off */
+static char *scull_compress_alg = "lz4";
+
+module_param(scull_compress_secs, int, S_IRUGO);
+module_param(scull_compress_alg, charp, S_IRUGO);
+
+static struct crypto_acomp *scull_acomp;
+static unsigned long scull_compress_pressed; /* jiffies of the last kick */
+
+/* run one request through the compressor, returns the output length */
+static int scull_acomp_run(int compress, void *in, unsigned int ilen,
+                           void *out, unsigned int olen)
+{
+    struct scatterlist src, dst;
+    struct acomp_req *req;
+    DECLARE_CRYPTO_WAIT(wait);
+    int ret;
+
+    req = acomp_request_alloc(scull_acomp);
+    if (!req)
+        return -ENOMEM;
+    sg_init_one(&src, in, ilen);
+    sg_init_one(&dst, out, olen);
+    acomp_request_set_params(req, &src, &dst, ilen, olen);
+    acomp_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG,
+                               crypto_req_done, &wait);
+    if (compress)
+        ret = crypto_wait_req(crypto_acomp_compress(req), &wait);
+    else
+        ret = crypto_wait_req(crypto_acomp_decompress(req), &wait);
+    if (!ret)
+        ret = req->dlen;
+    acomp_request_free(req);
+    return ret;
+}
+
+/*
+** Decompress the quantum in *slot back into a plain one. The caller
+** keeps the slot from changing: it holds the qset lock, or the device
+** locked for writing. Nobody else looks inside a packed quantum, so it
+** can go at once.
+*/
+void *scull_unpack_locked(struct scull_dev *dev, void **slot)
+{
+    struct scull_packed *pk;
+    void *q = *slot;
+    void *data;
+
+    if (!scull_q_is_packed(q))
+        return q;
+    pk = scull_q_packed(q);
+
+    data = scull_alloc_quantum(dev->quantum);
+    if (!data)
+        return NULL;
+    if (scull_acomp_run(0, pk->data, pk->len, data, dev->quantum) != dev->quantum) {
+        scull_free_quantum(dev->quantum, data);
+        return NULL;
+    }
+    smp_store_release(slot, data);
+    atomic_long_sub(dev->quantum, &dev->stats.packed_raw);
+    atomic_long_sub(pk->len, &dev->stats.packed_bytes);
+    kfree(pk);
+    return data;
+}
+
+/* for lockless readers that ran into a packed quantum */
+void *scull_unpack(struct scull_dev *dev, struct scull_qset *dptr, int s_pos)
+{
+    void *data;
+
+    mutex_lock(&dptr->lock);
+    data = scull_unpack_locked(dev, &dptr->data[s_pos]);
+    mutex_unlock(&dptr->lock);
+    return data;
+}
+
+/* a packed quantum is being dropped from one of dev's slots */
+void scull_packed_forget(struct scull_dev *dev, void *q)
+{
+    if (!scull_q_is_packed(q))
+        return;
+    atomic_long_sub(dev->quantum, &dev->stats.packed_raw);
+    atomic_long_sub(scull_q_packed(q)->len, &dev->stats.packed_bytes);
+}
+
+/* can this quantum be compressed now? */
+static int scull_packable(int quantum, void *q)
+{
+    if (!q || scull_q_is_zero(q) || scull_q_is_shared(q) || scull_q_is_packed(q))
+        return 0;
+    /* mapped pages would keep the old copy alive, and writable */
+    if (scull_quantum_paged(quantum) && page_count(virt_to_head_page(q)) != 1)
+        return 0;
+    return 1;
+}
+
+/* the plain quanta a qset had before packing, freed after a grace period */
+struct scull_pack_old {
+    struct rcu_head rcu;
+    int quantum, nr;
+    void *q[];
+};
+
+static void scull_pack_old_free(struct rcu_head *rcu)
+{
+    struct scull_pack_old *po = container_of(rcu, struct scull_pack_old, rcu);
+    int i;
+
+    for (i = 0; i < po->nr; i++)
+        scull_free_quantum(po->quantum, po->q[i]);
+    kfree(po);
+}
+
+/*
+** Compress what can be compressed in one cold qset. The plain quanta
+** are only freed after an SRCU grace period, since lockless readers
+** may still be copying out of them; that is left to call_srcu, so the
+** pass never waits for one with the device locked. *po is where they
+** go, and is handed on (and reset) if this qset filled it.
+*/
+static void scull_pack_qset(struct scull_dev *dev, struct scull_qset *dptr,
+                            void *scratch, struct scull_pack_old **po)
+{
+    int quantum = dev->quantum;
+    struct scull_packed *pk;
+    void **data;
+    int i, len;
+
+    mutex_lock(&dptr->lock);
+    data = dptr->data;
+    for (i = 0; data && i < dev->qset; i++) {
+        if (!scull_packable(quantum, data[i]))
+            continue;
+        len = scull_acomp_run(1, data[i], quantum, scratch, quantum * 3 / 4);
+        if (len <= 0)
+            continue; /* doesn't compress well enough */
+        pk = kmalloc(sizeof(*pk) + len, GFP_KERNEL);
+        if (!pk)
+            break;
+        pk->len = len;
+        memcpy(pk->data, scratch, len);
+        (*po)->q[(*po)->nr++] = data[i];
+        smp_store_release(&data[i], (void *)((unsigned long)pk | SCULL_Q_PACKED));
+        atomic_long_add(quantum, &dev->stats.packed_raw);
+        atomic_long_add(len, &dev->stats.packed_bytes);
+    }
+    mutex_unlock(&dptr->lock);
+
+    if (!(*po)->nr)
+        return;
+    (*po)->quantum = quantum;
+    call_srcu(&scull_srcu, &(*po)->rcu, scull_pack_old_free);
+    *po = NULL;
+}
+
+static void scull_compress_worker(struct work_struct *work)
+{
+    struct scull_dev *dev = container_of(to_delayed_work(work),
+                                         struct scull_dev, compress);
+    unsigned long period = scull_compress_secs * HZ;
+    unsigned long idle = period;
+    struct scull_pack_old *po = NULL;
+    struct scull_qset *dptr;
+    unsigned long index;
+    void *scratch = NULL;
+
+    /* for a period after memory pressure, pack whatever is merely quiet */
+    if (time_before(jiffies, READ_ONCE(scull_compress_pressed) + period))
+        idle = HZ;
+    down_read(&dev->rwsem);
+    scratch = kmalloc(dev->quantum, GFP_KERNEL);
+    xa_for_each(dev->qsets, index, dptr) {
+        if (!scratch)
+            break;
+        if (time_before(jiffies, READ_ONCE(dptr->touched) + idle))
+            continue;
+        if (!po) {
+            po = kmalloc(struct_size(po, q, dev->qset), GFP_KERNEL);
+            if (!po)
+                break;
+            po->nr = 0;
+        }
+        scull_pack_qset(dev, dptr, scratch, &po);
+        cond_resched();
+    }
+    up_read(&dev->rwsem);
+    kfree(scratch);
+    kfree(po); /* left over, holding nothing */
+
+    queue_delayed_work(system_unbound_wq, &dev->compress, period);
+}
+
+/* memory is short: run the compressor now, see budget.c */
+void scull_compress_kick(struct scull_dev *dev)
+{
+    if (!scull_acomp)
+        return;
+    WRITE_ONCE(scull_compress_pressed, jiffies);
+    mod_delayed_work(system_unbound_wq, &dev->compress, 0);
+}
+
+void scull_compress_dev_init(struct scull_dev *dev)
+{
+    INIT_DELAYED_WORK(&dev->compress, scull_compress_worker);
+    if (scull_acomp)
+        queue_delayed_work(system_unbound_wq, &dev->compress,
+                           scull_compress_secs * HZ);
+}
+
+void scull_compress_dev_cleanup(struct scull_dev *dev)
+{
+    cancel_delayed_work_sync(&dev->compress);
+}
+
+/* compression is simply off if the algorithm isn't there */
+void scull_compress_init(void)
+{
+    struct crypto_acomp *tfm;
+
+    if (scull_compress_secs <= 0)
+        return;
+    tfm = crypto_alloc_acomp(scull_compress_alg, 0, 0);
+    if (IS_ERR(tfm)) {
+        printk(KERN_WARNING "scull: no compressor \"%s\", compression off\n",
+               scull_compress_alg);
+        return;
+    }
+    scull_acomp = tfm;
+}
+
+void scull_compress_cleanup(void)
+{
+    if (scull_acomp)
+        crypto_free_acomp(scull_acomp);
+    scull_acomp = NULL;
+}
@@ -0,0 +1,184 @@
+/*
+ * dedup.c -- deduplication of whole-quantum writes
+ *
+ * With scull_dedup set, a write that covers a whole quantum is first
+ * collected in a buffer of its own. If it is all zeroes, the slot gets
+ * the SCULL_Q_ZERO marker and no memory at all. With scull_dedup=2 the
+ * buffer is also hashed and, if an identical quantum is already stored
+ * anywhere, the slot just takes a reference to it; otherwise the buffer
+ * is stored as a shared quantum and entered in the table, so that later
+ * writes can find it. Writes into a shared quantum copy it first, as
+ * usual, so the quanta in the table never change.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/spinlock.h>
+#include <linux/hashtable.h>
+#include <linux/xxhash.h>
+#include <linux/uio.h>
+#include <linux/uaccess.h>
+
+#include "scull.h"
+
+int scull_dedup = 0; /* 1: zero quanta, 2: identical quanta as well */
+
+module_param(scull_dedup, int, S_IRUGO);
+
+#define SCULL_DEDUP_BITS 12
+
+static DEFINE_HASHTABLE(scull_dedup_table, SCULL_DEDUP_BITS);
+static DEFINE_SPINLOCK(scull_dedup_lock);
+
+/*
+** Return a reference to a stored quantum identical to buf, or enter buf
+** in the table wrapped in "sh". Either way the result is a tagged slot
+** value; buf is freed if it wasn't needed.
+*/
+static void *scull_dedup_lookup(struct scull_dev *dev, void *buf,
+                                struct scull_shared *sh)
+{
+    int quantum = dev->quantum;
+    u64 hash = xxh64(buf, quantum, quantum);
+    struct scull_shared *cur;
+
+    spin_lock(&scull_dedup_lock);
+    hash_for_each_possible(scull_dedup_table, cur, hnode, hash) {
+        if (cur->hash != hash || cur->quantum != quantum ||
+            memcmp(cur->data, buf, quantum))
+            continue;
+        if (!refcount_inc_not_zero(&cur->ref))
+            continue; /* on its way out */
+        spin_unlock(&scull_dedup_lock);
+        kfree(sh);
+        scull_free_quantum(quantum, buf);
+        scull_stat_inc(&dev->stats, dedup_hits);
+        scull_stat_add(&dev->stats, dedup_saved, quantum);
+        return (void *)((unsigned long)cur | SCULL_Q_SHARED);
+    }
+    refcount_set(&sh->ref, 1);
+    sh->quantum = quantum;
+    sh->data = buf;
+    sh->hash = hash;
+    hash_add(scull_dedup_table, &sh->hnode, hash);
+    spin_unlock(&scull_dedup_lock);
+    return (void *)((unsigned long)sh | SCULL_Q_SHARED);
+}
+
+/*
+** Store the freshly written quantum buf into *slot, replacing old. The
+** device has been charged for the slot holding a quantum.
+*/
+static void scull_dedup_store(struct scull_dev *dev, void **slot, void *buf)
+{
+    int quantum = dev->quantum;
+    struct scull_shared *sh;
+    void *old = *slot;
+    void *q = buf;
+
+    if (!memchr_inv(buf, 0, quantum)) {
+        scull_free_quantum(quantum, buf);
+        q = SCULL_Q_ZERO;
+        scull_uncharge(dev, quantum);
+        scull_stat_inc(&dev->stats, dedup_zero);
+        scull_stat_add(&dev->stats, dedup_saved, quantum);
+    } else if (scull_dedup > 1) {
+        /* without a descriptor it is just kept private */
+        sh = kmalloc(sizeof(*sh), GFP_KERNEL_ACCOUNT);
+        if (sh)
+            q = scull_dedup_lookup(dev, buf, sh);
+    }
+    smp_store_release(slot, q);
+    /* old was empty, a marker or shared: readers are covered by SRCU */
+    scull_put_quantum(quantum, old);
+}
+
+/*
+** Write a whole quantum from "from" into slot s_pos of dptr, which the
+** caller has locked. Returns the bytes taken from "from", or 0 if the
+** slot holds a private quantum; that one is simply written in place by
+** the caller. Nothing is faulted in under the lock: EFAULT means the
+** caller has to do that and try again.
+*/
+ssize_t scull_dedup_write(struct scull_dev *dev, struct scull_qset *dptr,
+                          int s_pos, struct iov_iter *from)
+{
+    int quantum = dev->quantum;
+    void **slot, *old, *buf;
+    size_t copied;
+    int charged;
+
+    slot = scull_get_slot(dev, dptr, s_pos);
+    if (!slot)
+        return -ENOMEM;
+    old = *slot;
+    if (scull_q_is_packed(old)) {
+        if (!scull_unpack_locked(dev, slot))
+            return -ENOMEM;
+        return 0;
+    }
+    if (old && !scull_q_is_zero(old) && !scull_q_is_shared(old))
+        return 0;
+
+    charged = !scull_q_holds(old);
+    if (charged && scull_charge(dev, quantum))
+        return -ENOSPC;
+    buf = scull_alloc_quantum_node(quantum, scull_dev_node(dev));
+    if (!buf) {
+        if (charged)
+            scull_uncharge(dev, quantum);
+        scull_stat_inc(&dev->stats, alloc_failures);
+        return -ENOMEM;
+    }
+    pagefault_disable();
+    copied = copy_from_iter(buf, quantum, from);
+    pagefault_enable();
+    if (!copied) {
+        if (charged)
+            scull_uncharge(dev, quantum);
+        scull_free_quantum(quantum, buf);
+        return -EFAULT;
+    }
+    /* a short copy keeps what was there after it */
+    if (copied < quantum) {
+        if (scull_q_is_shared(old))
+            memcpy(buf + copied, scull_q_shared(old)->data + copied,
+                   quantum - copied);
+        else
+            memset(buf + copied, 0, quantum - copied);
+    }
+    scull_dedup_store(dev, slot, buf);
+    return copied;
+}
+
+/*
+** May the holder of the only reference to sh take it back and write to
+** it? A quantum in the table can still be found, so that is decided
+** under the table lock, and it leaves the table if so.
+*/
+int scull_dedup_claim(struct scull_shared *sh)
+{
+    int ok;
+
+    if (hlist_unhashed(&sh->hnode))
+        return refcount_read(&sh->ref) == 1;
+    spin_lock(&scull_dedup_lock);
+    ok = refcount_read(&sh->ref) == 1;
+    if (ok)
+        hash_del(&sh->hnode);
+    spin_unlock(&scull_dedup_lock);
+    return ok;
+}
+
+/* sh is about to be freed */
+void scull_dedup_forget(struct scull_shared *sh)
+{
+    if (hlist_unhashed(&sh->hnode))
+        return;
+    spin_lock(&scull_dedup_lock);
+    hash_del(&sh->hnode);
+    spin_unlock(&scull_dedup_lock);
+}
@@ -24,11 +24,26 @@
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/workqueue.h>
+#include <linux/file.h>
+#include <linux/srcu.h>
+#include <linux/overflow.h>
 
 #include <linux/uaccess.h>
 
 #include "scull.h"
 #include "proc_ops_version.h"
+#include "splice_version.h"
+#include "uio_version.h"
+#include "mm_version.h"
+
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
 
 /*
 ** Parameters which can be set at load time
@@ -38,12 +53,16 @@ int scull_minor = 0;
 int scull_nr_devs = SCULL_NR_DEVS; /* number of bare devices */
 int scull_quantum = SCULL_QUANTUM;
 int scull_qset = SCULL_QSET;
+int scull_legacy_rw = 0; /* use the one-quantum-per-call read/write */
+int scull_pool_quanta = 0; /* preallocated quanta per device, 0 = none */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_legacy_rw, int, S_IRUGO);
+module_param(scull_pool_quanta, int, S_IRUGO);
 
 
 MODULE_AUTHOR("Kajetan Puchalski");
@@ -52,35 +71,210 @@ MODULE_LICENSE("Dual BSD/GPL");
 /* allocated in scull_init_module */
 struct scull_dev *scull_devices;
 
-/* empty the scull device */
-/* has to be called when the device semaphore is held */
-int scull_trim(struct scull_dev *dev)
+/* what the stats file has to say about a bare device in particular */
+static void scull_dev_show(struct seq_file *s, struct scull_stats *st)
+{
+    scull_numa_show(s, st);
+    scull_adapt_show(s, st);
+}
+
+/* the minor number, as reported by the tracepoints */
+static inline unsigned int scull_dev_minor(struct scull_dev *dev)
+{
+    return MINOR(dev->cdev.dev);
+}
+
+/*
+** Trimming is split in two: scull_trim swaps an empty xarray in for the
+** device's, which then looks empty at once, and the old one is walked
+** and handed back from scull_trim_wq. The xarray is allocated on its
+** own because its nodes point back at it, so it can't be copied out of
+** the device. The sets go out in batches of SCULL_TRIM_BATCH, so a large
+** device (or all of them at unload) is freed on several CPUs.
+*/
+#define SCULL_TRIM_BATCH 16
+
+struct scull_trim_work {
+    struct work_struct work;
+    struct list_head qsets;
+    int quantum, qset; /* the geometry the sets were allocated with */
+    int count;
+    unsigned int minor;
+};
+
+struct scull_qsets {
+    struct xarray xa;
+    struct work_struct work;
+    int quantum, qset; /* the geometry of the sets, once detached */
+    unsigned int minor;
+};
+
+static struct workqueue_struct *scull_trim_wq;
+atomic_long_t scull_trim_backlog; /* sets queued for freeing, for budget.c */
+
+static void scull_free_qset_data(struct scull_qset *dptr, int quantum, int qset)
 {
-    struct scull_qset *next, *dptr;
-    int qset = dev->qset;
     int i;
 
-    for (dptr = dev->data; dptr; dptr = next) {
-        if (dptr->data) {
-            for (i = 0; i < qset; i++)
-                kfree(dptr->data[i]);
-            kfree(dptr->data);
-            dptr->data = NULL;
+    if (dptr->data) {
+        for (i = 0; i < qset; i++)
+            scull_put_quantum(quantum, dptr->data[i]);
+        scull_free_array(qset, dptr->data);
+        dptr->data = NULL;
+    }
+    scull_free_qset(dptr);
+}
+
+static void scull_trim_worker(struct work_struct *work)
+{
+    struct scull_trim_work *tw = container_of(work, struct scull_trim_work, work);
+    struct scull_qset *dptr, *next;
+    u64 start = local_clock();
+
+    list_for_each_entry_safe(dptr, next, &tw->qsets, list)
+        scull_free_qset_data(dptr, tw->quantum, tw->qset);
+    atomic_long_sub(tw->count, &scull_trim_backlog);
+    trace_scull_trim(tw->minor, tw->count, local_clock() - start);
+    kfree(tw);
+}
+
+static void scull_trim_batch(struct scull_trim_work **tw, unsigned int minor,
+                             struct scull_qset *dptr, int quantum, int qset)
+{
+    if (!*tw && scull_trim_wq) {
+        *tw = kmalloc(sizeof(**tw), GFP_KERNEL);
+        if (*tw) {
+            INIT_WORK(&(*tw)->work, scull_trim_worker);
+            INIT_LIST_HEAD(&(*tw)->qsets);
+            (*tw)->quantum = quantum;
+            (*tw)->qset = qset;
+            (*tw)->count = 0;
+            (*tw)->minor = minor;
         }
-        next = dptr->next;
-        kfree(dptr);
     }
+    if (!*tw) { /* no memory to defer it, do it now */
+        scull_free_qset_data(dptr, quantum, qset);
+        return;
+    }
+    list_add_tail(&dptr->list, &(*tw)->qsets);
+    atomic_long_inc(&scull_trim_backlog);
+    if (++(*tw)->count == SCULL_TRIM_BATCH) {
+        queue_work(scull_trim_wq, &(*tw)->work);
+        *tw = NULL;
+    }
+}
+
+/*
+** Hand dptr, which has already left its device and has the given
+** geometry, to the batch being built in *tw. Batches go out when they
+** are full, or with scull_trim_flush.
+*/
+void scull_trim_add(struct scull_dev *dev, struct scull_trim_work **tw,
+                    struct scull_qset *dptr, int quantum, int qset)
+{
+    scull_trim_batch(tw, scull_dev_minor(dev), dptr, quantum, qset);
+}
+
+void scull_trim_flush(struct scull_trim_work *tw)
+{
+    if (tw)
+        queue_work(scull_trim_wq, &tw->work);
+}
+
+/* walk a detached xarray, batching its sets up for freeing */
+static void scull_qsets_worker(struct work_struct *work)
+{
+    struct scull_qsets *qs = container_of(work, struct scull_qsets, work);
+    struct scull_trim_work *tw = NULL;
+    struct scull_qset *dptr;
+    unsigned long index;
+
+    xa_for_each(&qs->xa, index, dptr) {
+        scull_trim_batch(&tw, qs->minor, dptr, qs->quantum, qs->qset);
+        cond_resched();
+    }
+    scull_trim_flush(tw);
+    xa_destroy(&qs->xa);
+    kfree(qs);
+}
+
+struct xarray *scull_qsets_alloc(void)
+{
+    struct scull_qsets *qs = kmalloc(sizeof(*qs), GFP_KERNEL);
+
+    if (!qs)
+        return NULL;
+    xa_init(&qs->xa);
+    INIT_WORK(&qs->work, scull_qsets_worker);
+    return &qs->xa;
+}
 
+/* free qsets, which has just left dev, with the geometry dev still has */
+static void scull_qsets_release(struct scull_dev *dev, struct xarray *qsets)
+{
+    struct scull_qsets *qs = container_of(qsets, struct scull_qsets, xa);
+
+    qs->quantum = dev->quantum;
+    qs->qset = dev->qset;
+    qs->minor = scull_dev_minor(dev);
+    if (scull_trim_wq)
+        queue_work(scull_trim_wq, &qs->work);
+    else
+        scull_qsets_worker(&qs->work);
+}
+
+/* let go of all of dev's memory, for good; only at cleanup */
+void scull_qsets_free(struct scull_dev *dev)
+{
+    if (dev->qsets)
+        scull_qsets_release(dev, dev->qsets);
+    dev->qsets = NULL;
+}
+
+/* empty the scull device */
+/* has to be called with the device semaphore held for writing */
+int scull_trim(struct scull_dev *dev)
+{
+    struct xarray *qsets = scull_qsets_alloc();
+    struct scull_trim_work *tw = NULL;
+    struct scull_qset *dptr;
+    unsigned long index;
+
+    if (qsets) {
+        swap(qsets, dev->qsets);
+        scull_qsets_release(dev, qsets);
+    } else { /* no memory for a new xarray, empty this one */
+        xa_for_each(dev->qsets, index, dptr) {
+            xa_erase(dev->qsets, index);
+            scull_trim_add(dev, &tw, dptr, dev->quantum, dev->qset);
+        }
+        scull_trim_flush(tw);
+        xa_destroy(dev->qsets);
+    }
+    atomic_long_set(&dev->stats.packed_raw, 0);
+    atomic_long_set(&dev->stats.packed_bytes, 0);
+    atomic_long_set(&dev->stats.charged, 0);
+    atomic_long_set(&dev->stats.filled, 0);
+
+    dev->gen++; /* cursors may point at the qsets just dropped */
+    if (dev->adaptive && !dev->geom_quantum)
+        dev->quantum = scull_adapt_quantum(dev); /* looks at the old size */
+    else
+        dev->quantum = dev->geom_quantum ? dev->geom_quantum : scull_quantum;
+    dev->qset = dev->geom_qset ? dev->geom_qset : scull_qset;
     dev->size = 0;
-    dev->quantum = scull_quantum;
-    dev->qset = scull_qset;
-    dev->data = NULL;
 
     return 0;
 }
 
 #ifdef SCULL_DEBUG // use proc only in debug mode
 
+/* is qset number "index" the last one allocated on the device? */
+static int scull_qset_is_last(struct scull_dev *dev, unsigned long index)
+{
+    return xa_find_after(dev->qsets, &index, ULONG_MAX, XA_PRESENT) == NULL;
+}
+
 /*
 ** proc filesystem for debugging
 */
@@ -91,23 +285,26 @@ int scull_read_procmem(struct seq_file *s, void *v)
 
     for (i = 0; i < scull_nr_devs && s->count <= limit; i++) {
         struct scull_dev *d = &scull_devices[i];
-        struct scull_qset *qs = d->data;
+        struct scull_qset *qs;
+        unsigned long index;
 
-        if (mutex_lock_interruptible(&d->lock))
+        if (down_read_killable(&d->rwsem))
             return -ERESTARTSYS;
 
-        seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
+        seq_printf(s, "\nDevice %i: qset %i, q %i, sz %lu\n",
                    i, d->qset, d->quantum, d->size);
-        for (; qs && s->count <= limit; qs = qs->next) {
-            seq_printf(s, " item at %p, qset at %p\n", qs, qs->data);
-            if (qs->data && !qs->next)
+        xa_for_each(d->qsets, index, qs) {
+            if (s->count > limit)
+                break;
+            seq_printf(s, " item %lu at %p, qset at %p\n", index, qs, qs->data);
+            if (qs->data && scull_qset_is_last(d, index))
                 for (j = 0 ; j < d->qset; j++) {
                     if (qs->data[j])
                         seq_printf(s, "   % 4i: %8p\n", j, qs->data[j]);
                 }
         }
 
-        mutex_unlock(&d->lock);
+        up_read(&d->rwsem);
     }
 
     seq_printf(s, "\nSCULL_IOCQQUANTUM: %i\n", SCULL_IOCQQUANTUM);
@@ -146,21 +343,22 @@ static int scull_seq_show(struct seq_file *s, void *v)
 {
     struct scull_dev *dev = (struct scull_dev*) v;
     struct scull_qset *d;
+    unsigned long index;
     int i;
 
-    if (mutex_lock_interruptible(&dev->lock))
+    if (down_read_killable(&dev->rwsem))
         return -ERESTARTSYS;
-    seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
+    seq_printf(s, "\nDevice %i: qset %i, q %i, sz %lu\n",
                (int)(dev - scull_devices), dev->qset, dev->quantum, dev->size);
-    for (d = dev->data; d; d = d->next) {
-        seq_printf(s, " item at %p, qset at %p\n", d, d->data);
-        if (d->data && !d->next)
+    xa_for_each(dev->qsets, index, d) {
+        seq_printf(s, " item %lu at %p, qset at %p\n", index, d, d->data);
+        if (d->data && scull_qset_is_last(dev, index))
             for (i = 0 ; i < dev->qset; i++) {
                 if (d->data[i])
                     seq_printf(s, "   % 4i: %8p\n", i, d->data[i]);
             }
     }
-    mutex_unlock(&dev->lock);
+    up_read(&dev->rwsem);
 
     return 0;
 }
@@ -228,135 +426,706 @@ static void scull_remove_proc(void)
 #endif // SCULL_DEBUG
 
 
-struct scull_qset *scull_follow(struct scull_dev *dev, int n)
+/*
+** Find quantum set number n, allocating it if needed.
+** The xarray makes this a radix-tree lookup instead of a list walk,
+** so the cost no longer grows with the file position. New qsets are
+** published with xa_cmpxchg, so concurrent writers need no device lock:
+** whoever loses the race frees its copy and uses the winner's.
+*/
+struct scull_qset *scull_follow(struct scull_dev *dev, unsigned long n)
 {
-    struct scull_qset *qs = dev->data;
+    struct scull_qset *qs = xa_load(dev->qsets, n);
+    void *old;
+
+    if (qs) {
+        trace_scull_follow(scull_dev_minor(dev), n, 0);
+        return qs;
+    }
 
     /* allocate the qset if needed */
-    if (!qs) {
-        qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-        if (qs == NULL)
+    qs = scull_alloc_qset();
+    trace_scull_alloc(scull_dev_minor(dev), SCULL_ALLOC_QSET,
+                      sizeof(struct scull_qset), qs != NULL);
+    if (qs == NULL)
+        goto nomem;
+    old = xa_cmpxchg(dev->qsets, n, NULL, qs, GFP_KERNEL);
+    if (old) {
+        scull_free_qset(qs);
+        if (xa_is_err(old))
+            goto nomem;
+        trace_scull_follow(scull_dev_minor(dev), n, 0);
+        return old;
+    }
+
+    trace_scull_follow(scull_dev_minor(dev), n, 1);
+    return qs;
+
+    nomem:
+        scull_stat_inc(&dev->stats, alloc_failures);
+        return NULL;
+}
+
+/*
+** Lockless lookup of quantum s_pos in qset "item", for readers.
+** Writers publish new arrays and quanta with release semantics.
+** The caller holds scull_srcu while it uses the data. A compressed
+** quantum is unpacked on the way, which may fail.
+*/
+void *scull_qset_quantum(struct scull_dev *dev, struct scull_qset *dptr,
+                         int s_pos)
+{
+    void **data;
+    void *q;
+
+    if (dptr == NULL)
+        return NULL;
+    scull_qset_touch(dptr);
+    data = smp_load_acquire(&dptr->data);
+    if (data == NULL)
+        return NULL;
+    q = smp_load_acquire(&data[s_pos]);
+    if (scull_q_is_packed(q)) {
+        q = scull_unpack(dev, dptr, s_pos);
+        return q ? q : ERR_PTR(-ENOMEM);
+    }
+    return scull_q_data(q);
+}
+
+static void *scull_lookup_quantum(struct scull_dev *dev, unsigned long item,
+                                  int s_pos)
+{
+    return scull_qset_quantum(dev, xa_load(dev->qsets, item), s_pos);
+}
+
+/*
+** Cursors (see struct scull_cursor). A call starting where the file's
+** last one stopped takes its cursor as it is; anything else computes
+** a new one.
+*/
+static void scull_cursor_get(struct file *filp, struct scull_dev *dev,
+                             loff_t pos, struct scull_cursor *cur)
+{
+    struct scull_file *sf = filp->private_data;
+
+    spin_lock(&sf->lock);
+    *cur = sf->cur;
+    spin_unlock(&sf->lock);
+    if (cur->gen == dev->gen && cur->pos == pos)
+        return;
+
+    cur->gen = dev->gen;
+    cur->pos = pos;
+    cur->dptr = NULL;
+    cur->item = scull_split(dev, pos, &cur->s_pos, &cur->q_pos);
+}
+
+static void scull_cursor_put(struct file *filp, struct scull_cursor *cur)
+{
+    struct scull_file *sf = filp->private_data;
+
+    spin_lock(&sf->lock);
+    sf->cur = *cur;
+    spin_unlock(&sf->lock);
+}
+
+/* move on by n bytes, which never go past the current quantum */
+static void scull_cursor_advance(struct scull_dev *dev,
+                                 struct scull_cursor *cur, size_t n)
+{
+    cur->pos += n;
+    cur->q_pos += n;
+    if (cur->q_pos < dev->quantum)
+        return;
+    cur->q_pos = 0;
+    if (++cur->s_pos < dev->qset)
+        return;
+    cur->s_pos = 0;
+    cur->item++;
+    cur->dptr = NULL;
+}
+
+/*
+** Return the slot for quantum s_pos of dptr, allocating the pointer
+** array if needed. Called with dptr->lock held, or with the device
+** locked for writing.
+*/
+void **scull_get_slot(struct scull_dev *dev, struct scull_qset *dptr, int s_pos)
+{
+    void **data = dptr->data;
+
+    /* allocate & initialise the array of pointers */
+    if (!data) {
+        data = scull_alloc_array(dev->qset);
+        trace_scull_alloc(scull_dev_minor(dev), SCULL_ALLOC_ARRAY,
+                          dev->qset * sizeof(char*), data != NULL);
+        if (!data) {
+            scull_stat_inc(&dev->stats, alloc_failures);
             return NULL;
-        memset(qs, 0, sizeof(scull_qset));
+        }
+        smp_store_release(&dptr->data, data);
     }
+    return &data[s_pos];
+}
 
-    /* follow the list */
-    while (n--) {
-        if (!qs->next) {
-            qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-            if (qs->next == NULL)
-                return NULL;
-            memset(qs->next, 0, sizeof(struct scull_qset));
+/*
+** Return quantum s_pos of dptr, ready to be written to: allocate it if
+** needed (or if it is only a zero marker), unpack it if it is compressed
+** and make a private copy if it is shared. Called with dptr->lock held.
+** Fails with -ENOMEM, or -ENOSPC if the device is over its budget.
+*/
+static void *scull_get_quantum(struct scull_dev *dev, struct scull_qset *dptr,
+                               int s_pos)
+{
+    void **slot = scull_get_slot(dev, dptr, s_pos);
+    void *quantum = NULL;
+    int node;
+
+    if (!slot)
+        return ERR_PTR(-ENOMEM);
+    if (!scull_q_holds(*slot) && scull_charge(dev, dev->quantum))
+        return ERR_PTR(-ENOSPC);
+    /*
+     * Allocate the quantum to be written to, preferably carved from a
+     * large page or taken from the pool; those are only used with the
+     * default placement, since the large pages are local to whoever
+     * needed a new one and pool quanta are wherever the refill worker
+     * happened to run.
+     */
+    if (!*slot) {
+        node = scull_dev_node(dev);
+        if (node == NUMA_NO_NODE)
+            quantum = scull_carve_quantum(dev, dev->quantum);
+        if (!quantum) {
+            if (node == NUMA_NO_NODE)
+                quantum = scull_pool_get(&dev->pool, dev->quantum);
+            if (quantum) {
+                scull_stat_inc(&dev->stats, pool_hits);
+            } else {
+                if (dev->pool.target)
+                    scull_stat_inc(&dev->stats, pool_misses);
+                quantum = scull_alloc_quantum_node(dev->quantum, node);
+                trace_scull_alloc(scull_dev_minor(dev), SCULL_ALLOC_QUANTUM,
+                                  dev->quantum, quantum != NULL);
+                if (!quantum)
+                    goto uncharge;
+            }
         }
-        qs = qs->next;
-        continue;
+        smp_store_release(slot, quantum);
+    } else if (scull_q_is_zero(*slot)) {
+        quantum = scull_alloc_quantum_node(dev->quantum, scull_dev_node(dev));
+        if (!quantum)
+            goto uncharge;
+        smp_store_release(slot, quantum);
+    } else if (scull_q_is_packed(*slot)) {
+        if (!scull_unpack_locked(dev, slot))
+            goto nomem;
+    } else if (scull_q_is_shared(*slot)) {
+        if (!scull_unshare_quantum(dev->quantum, slot))
+            goto nomem;
     }
+    return *slot;
 
-    return qs;
+    uncharge:
+        scull_uncharge(dev, dev->quantum);
+    nomem:
+        scull_stat_inc(&dev->stats, alloc_failures);
+        return ERR_PTR(-ENOMEM);
+}
+
+/*
+** Writers take the lock of the qset they write to, so writers to
+** disjoint qsets run in parallel and only share dev->rwsem. Keep the
+** current qset locked across consecutive quanta; "locked" is the qset
+** the caller holds (or NULL) and is updated on return.
+*/
+static void scull_lock_qset(struct scull_qset *dptr, struct scull_qset **locked)
+{
+    scull_qset_touch(dptr);
+    if (dptr != *locked) {
+        if (*locked)
+            mutex_unlock(&(*locked)->lock);
+        mutex_lock(&dptr->lock);
+        *locked = dptr;
+    }
+}
+
+static void *scull_quantum_for_write(struct scull_dev *dev, unsigned long item,
+                                     int s_pos, struct scull_qset **locked)
+{
+    struct scull_qset *dptr = scull_follow(dev, item);
+
+    if (dptr == NULL)
+        return ERR_PTR(-ENOMEM);
+    scull_lock_qset(dptr, locked);
+    return scull_get_quantum(dev, dptr, s_pos);
+}
+
+/* for the adaptive geometry: did this write carry on from the last one? */
+static void scull_note_write(struct scull_dev *dev, loff_t pos, size_t len)
+{
+    if (pos == READ_ONCE(dev->last_end))
+        scull_stat_inc(&dev->stats, seq_writes);
+    WRITE_ONCE(dev->last_end, pos + len);
+}
+
+/* is slot s_pos of dptr empty? dptr is locked, or the whole device */
+static int scull_slot_empty(struct scull_qset *dptr, int s_pos)
+{
+    return !dptr || !dptr->data || !dptr->data[s_pos];
+}
+
+/*
+** For the fragmentation figure in adapt.c: count the bytes a write put
+** where there was nothing, into a slot that was empty (fresh) or past
+** the end of the device. The rest of what it wrote overwrote data.
+*/
+static void scull_note_fill(struct scull_dev *dev, int fresh, loff_t pos,
+                            size_t len)
+{
+    unsigned long size = READ_ONCE(dev->size);
+
+    if (!fresh)
+        len = pos + len > size ? pos + len - max_t(u64, pos, size) : 0;
+    if (len)
+        atomic_long_add(len, &dev->stats.filled);
+}
+
+/* writers run in parallel, so growing the size has to be atomic */
+static void scull_extend_size(struct scull_dev *dev, unsigned long pos)
+{
+    unsigned long size = READ_ONCE(dev->size);
+    unsigned long old;
+
+    while (size < pos) {
+        old = cmpxchg(&dev->size, size, pos);
+        if (old == size)
+            break;
+        size = old;
+    }
 }
 
+/*
+** The user buffer may be a mapping of this very device, and its fault
+** handler takes dev->rwsem and the qset locks too; so nothing here may
+** fault while holding them. The copies run with page faults disabled,
+** and a copy that falls short drops the locks, faults the buffer in
+** and tries again.
+*/
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
                    loff_t *f_pos)
 {
-    struct scull_dev *dev = filp->private_data;
-    struct scull_qset *dptr; /* first list item */
-    int quantum = dev->quantum;
-    int qset = dev->qset;
-    int itemsize = quantum * qset; /* bytes in the list item */
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = 0;
-
-    if (mutex_lock_interruptible(&dev->lock))
+    struct scull_dev *dev = scull_file_dev(filp);
+    struct scull_cursor cur;
+    unsigned long size, left;
+    int quantum;
+    void *data;
+    ssize_t retval;
+    int idx;
+    loff_t offset = *f_pos;
+    size_t requested = count;
+    u64 start = local_clock();
+
+    again:
+    retval = 0;
+    if (down_read_killable(&dev->rwsem))
         return -ERESTARTSYS;
+    scull_stat_lock_wait(&dev->stats, start);
+    idx = srcu_read_lock(&scull_srcu);
+
+    quantum = dev->quantum;
+    size = smp_load_acquire(&dev->size);
 
-    if (*f_pos >= dev->size)
+    if (*f_pos >= size)
         goto out;
-    if (*f_pos + count > dev->size)
-        count = dev->size - *f_pos;
+    if (*f_pos + count > size)
+        count = size - *f_pos;
 
     /* listitem, qset index & offset in the quantum */
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
-
-    /* follow the list up to the right position */
-    dptr = scull_follow(dev, item);
-
-    if (dptr == NULL || !dptr->data || !dptr->data[s_pos])
-        goto out; /* don't fill holes */
+    scull_cursor_get(filp, dev, *f_pos, &cur);
+
+    /* look up the right quantum, don't allocate on read */
+    if (!cur.dptr)
+        cur.dptr = xa_load(dev->qsets, cur.item);
+    data = scull_qset_quantum(dev, cur.dptr, cur.s_pos);
+    if (IS_ERR(data)) {
+        retval = PTR_ERR(data);
+        goto out;
+    }
 
     /* read only up to the end of this quantum */
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
-
-    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
+    if (count > quantum - cur.q_pos)
+        count = quantum - cur.q_pos;
+
+    pagefault_disable();
+    if (data == NULL) /* a hole reads as zeroes */
+        left = clear_user(buf, count);
+    else
+        left = copy_to_user(buf, data + cur.q_pos, count);
+    pagefault_enable();
+    if (left) {
         retval = -EFAULT;
         goto out;
     }
     *f_pos += count;
     retval = count;
+    scull_cursor_advance(dev, &cur, count);
+    scull_cursor_put(filp, &cur);
 
     out:
-        mutex_unlock(&dev->lock);
+        srcu_read_unlock(&scull_srcu, idx);
+        up_read(&dev->rwsem);
+        if (retval == -EFAULT && !fault_in_writeable(buf, count))
+            goto again;
+        trace_scull_read(scull_dev_minor(dev), offset, requested, retval,
+                         scull_stat_io(&dev->stats, 0, retval, start));
         return retval;
 }
 
 ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
                     loff_t *f_pos)
 {
-    struct scull_dev *dev = filp->private_data;
-    struct scull_qset *dptr;
-    int quantum = dev->quantum;
-    int qset = dev->qset;
-    int itemsize = quantum * qset;
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = -ENOMEM; /* value used in "goto out" statements */
+    struct scull_dev *dev = scull_file_dev(filp);
+    struct scull_qset *locked = NULL;
+    struct scull_cursor cur;
+    int quantum, fresh;
+    void *data;
+    ssize_t retval;
+    loff_t offset = *f_pos;
+    size_t requested = count;
+    u64 start = local_clock();
+
+    if (*f_pos >= SCULL_SIZE_MAX)
+        return -EFBIG;
+    again:
+    retval = scull_lock_for_change(dev, filp, 0);
+    if (retval)
+        return retval;
+    scull_stat_lock_wait(&dev->stats, start);
+    retval = -ENOMEM; /* value used in "goto out" statements */
 
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    quantum = dev->quantum;
 
     /* listitem, qset index & offset in the quantum */
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
+    scull_cursor_get(filp, dev, *f_pos, &cur);
 
-    /* follow the list up to the right position */
-    dptr = scull_follow(dev, item);
-    if (dptr == NULL)
+    /* find (or allocate) the right quantum */
+    if (!cur.dptr)
+        cur.dptr = scull_follow(dev, cur.item);
+    if (!cur.dptr)
+        goto out;
+    scull_lock_qset(cur.dptr, &locked);
+    fresh = scull_slot_empty(cur.dptr, cur.s_pos);
+    data = scull_get_quantum(dev, cur.dptr, cur.s_pos);
+    if (IS_ERR(data)) {
+        retval = PTR_ERR(data);
         goto out;
-    /* allocate & initialise the array of pointers */
-    if (!dptr->data) {
-        dptr->data = kmalloc(qset * sizeof(char*), GFP_KERNEL);
-        if (!dptr->data)
-            goto out;
-        memset(dptr->data, 0, qset * sizeof(char*));
-    }
-    /* allocate the quantum to be written to */
-    if (!dptr->data[s_pos]) {
-        dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-        if (!dptr->data[s_pos])
-            goto out;
     }
     /* write only up to the end of this quantum */
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
+    if (count > quantum - cur.q_pos)
+        count = quantum - cur.q_pos;
+    if (count > SCULL_SIZE_MAX - *f_pos)
+        count = SCULL_SIZE_MAX - *f_pos;
 
-    if (copy_from_user(dptr->data[s_pos]+q_pos, buf, count)) {
+    if (copy_from_user_nofault(data + cur.q_pos, buf, count)) {
         retval = -EFAULT;
         goto out;
     }
+    scull_note_fill(dev, fresh, *f_pos, count);
     *f_pos += count;
     retval = count;
+    scull_cursor_advance(dev, &cur, count);
+    scull_cursor_put(filp, &cur);
 
     /* update the size */
-    if (dev->size < *f_pos)
-        dev->size = *f_pos;
+    scull_extend_size(dev, *f_pos);
+    scull_note_write(dev, offset, count);
 
     out:
-        mutex_unlock(&dev->lock);
+        if (locked)
+            mutex_unlock(&locked->lock);
+        up_read(&dev->rwsem);
+        if (retval == -EFAULT && !fault_in_readable(buf, count)) {
+            locked = NULL;
+            goto again;
+        }
+        trace_scull_write(scull_dev_minor(dev), offset, requested, retval,
+                          scull_stat_io(&dev->stats, 1, retval, start));
+        return retval;
+}
+
+/*
+** Iterator based read and write: unlike scull_read and scull_write these
+** keep going across quantum and qset boundaries, so a single call (and a
+** single lock acquisition) moves the whole request. They also give us
+** readv/writev and preadv2/pwritev2 for free.
+*/
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct scull_dev *dev = scull_file_dev(filp);
+    struct scull_cursor cur;
+    loff_t pos = iocb->ki_pos;
+    unsigned long size;
+    size_t chunk, copied, left;
+    int quantum;
+    void *data;
+    ssize_t retval = 0;
+    int idx;
+    loff_t offset = iocb->ki_pos;
+    size_t requested = iov_iter_count(to);
+    u64 start = local_clock();
+
+    again:
+    left = 0;
+    if (down_read_killable(&dev->rwsem))
+        return retval ? retval : -ERESTARTSYS;
+    scull_stat_lock_wait(&dev->stats, start);
+    idx = srcu_read_lock(&scull_srcu);
+
+    quantum = dev->quantum;
+    size = smp_load_acquire(&dev->size);
+    scull_cursor_get(filp, dev, pos, &cur);
+
+    while (iov_iter_count(to) && pos < size) {
+        if (!cur.dptr)
+            cur.dptr = xa_load(dev->qsets, cur.item);
+        data = scull_qset_quantum(dev, cur.dptr, cur.s_pos);
+        if (IS_ERR(data)) {
+            if (!retval)
+                retval = PTR_ERR(data);
+            break;
+        }
+
+        chunk = min_t(size_t, quantum - cur.q_pos, iov_iter_count(to));
+        chunk = min_t(size_t, chunk, size - pos);
+        pagefault_disable(); /* see scull_read */
+        if (data)
+            copied = copy_to_iter(data + cur.q_pos, chunk, to);
+        else /* a hole reads as zeroes */
+            copied = iov_iter_zero(chunk, to);
+        pagefault_enable();
+        pos += copied;
+        retval += copied;
+        scull_cursor_advance(dev, &cur, copied);
+        if (copied < chunk) {
+            left = chunk - copied;
+            break;
+        }
+    }
+    iocb->ki_pos = pos;
+    scull_cursor_put(filp, &cur);
+
+    srcu_read_unlock(&scull_srcu, idx);
+    up_read(&dev->rwsem);
+    if (left) {
+        if (user_backed_iter(to) &&
+            fault_in_iov_iter_writeable(to, left) < left)
+            goto again;
+        if (!retval)
+            retval = -EFAULT;
+    }
+    trace_scull_read(scull_dev_minor(dev), offset, requested, retval,
+                     scull_stat_io(&dev->stats, 0, retval, start));
+    return retval;
+}
+
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *filp = iocb->ki_filp;
+    struct scull_dev *dev = scull_file_dev(filp);
+    struct scull_qset *locked = NULL;
+    struct scull_cursor cur;
+    loff_t pos = iocb->ki_pos;
+    size_t chunk, copied, left;
+    int quantum, fresh;
+    void *data;
+    ssize_t done, retval = 0;
+    loff_t offset = iocb->ki_pos;
+    size_t requested = iov_iter_count(from);
+    u64 start = local_clock();
+    int err;
+
+    if (pos >= SCULL_SIZE_MAX)
+        return -EFBIG;
+    iov_iter_truncate(from, SCULL_SIZE_MAX - pos);
+    again:
+    left = 0;
+    locked = NULL;
+    err = scull_lock_for_change(dev, filp, 0);
+    if (err)
+        return retval ? retval : err;
+    scull_stat_lock_wait(&dev->stats, start);
+
+    quantum = dev->quantum;
+    scull_cursor_get(filp, dev, pos, &cur);
+
+    while (iov_iter_count(from)) {
+        if (!cur.dptr)
+            cur.dptr = scull_follow(dev, cur.item);
+        if (!cur.dptr) {
+            if (!retval)
+                retval = -ENOMEM;
+            break;
+        }
+        scull_lock_qset(cur.dptr, &locked);
+
+        chunk = min_t(size_t, quantum - cur.q_pos, iov_iter_count(from));
+        copied = 0;
+        fresh = scull_slot_empty(cur.dptr, cur.s_pos);
+
+        /* whole quanta may not need memory of their own */
+        if (scull_dedup && chunk == quantum) {
+            done = scull_dedup_write(dev, cur.dptr, cur.s_pos, from);
+            if (done == -EFAULT) {
+                left = chunk;
+                break;
+            }
+            if (done < 0) {
+                if (!retval)
+                    retval = done;
+                break;
+            }
+            copied = done;
+        }
+
+        if (!copied) {
+            data = scull_get_quantum(dev, cur.dptr, cur.s_pos);
+            if (IS_ERR(data)) {
+                if (!retval)
+                    retval = PTR_ERR(data);
+                break;
+            }
+            pagefault_disable(); /* see scull_read */
+            copied = copy_from_iter(data + cur.q_pos, chunk, from);
+            pagefault_enable();
+        }
+        scull_note_fill(dev, fresh, pos, copied);
+        pos += copied;
+        retval += copied;
+        scull_cursor_advance(dev, &cur, copied);
+        if (copied < chunk) {
+            left = chunk - copied;
+            break;
+        }
+    }
+    if (locked)
+        mutex_unlock(&locked->lock);
+    iocb->ki_pos = pos;
+    scull_cursor_put(filp, &cur);
+
+    /* update the size, if anything was written */
+    if (retval > 0)
+        scull_extend_size(dev, pos);
+
+    up_read(&dev->rwsem);
+    if (left) {
+        if (user_backed_iter(from) &&
+            fault_in_iov_iter_readable(from, left) < left)
+            goto again;
+        if (!retval)
+            retval = -EFAULT;
+    }
+    if (retval > 0)
+        scull_note_write(dev, offset, retval);
+    trace_scull_write(scull_dev_minor(dev), offset, requested, retval,
+                      scull_stat_io(&dev->stats, 1, retval, start));
+    return retval;
+}
+
+/*
+** splice_read, which also serves sendfile(). Page-backed quanta are
+** handed to the pipe by reference instead of being copied; the pipe
+** buffers then share the device pages, so later writes to the device
+** show through, as they would with vmsplice(). Other geometries fall
+** back to copying through scull_read_iter.
+*/
+static void scull_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+    put_page(spd->pages[i]);
+}
+
+static ssize_t scull_splice_read(struct file *in, loff_t *ppos,
+                                 struct pipe_inode_info *pipe, size_t len,
+                                 unsigned int flags)
+{
+    struct scull_dev *dev = scull_file_dev(in);
+    struct page *pages[PIPE_DEF_BUFFERS];
+    struct partial_page partial[PIPE_DEF_BUFFERS];
+    struct splice_pipe_desc spd = {
+        .pages = pages,
+        .partial = partial,
+        .nr_pages_max = PIPE_DEF_BUFFERS,
+        .ops = &nosteal_pipe_buf_ops,
+        .spd_release = scull_spd_release,
+    };
+    loff_t pos = *ppos;
+    unsigned long item, size;
+    int s_pos, q_pos;
+    size_t chunk, poff;
+    void *data;
+    ssize_t retval = 0;
+    int idx;
+
+    if (down_read_killable(&dev->rwsem))
+        return -ERESTARTSYS;
+    /* the geometry only holds still under the lock */
+    if (!scull_quantum_paged(dev->quantum)) {
+        up_read(&dev->rwsem);
+        return compat_splice_read(in, ppos, pipe, len, flags);
+    }
+    idx = srcu_read_lock(&scull_srcu);
+
+    size = smp_load_acquire(&dev->size);
+
+    while (len && spd.nr_pages < PIPE_DEF_BUFFERS && pos < size) {
+        item = scull_split(dev, pos, &s_pos, &q_pos);
+
+        data = scull_lookup_quantum(dev, item, s_pos);
+        if (IS_ERR(data)) {
+            retval = PTR_ERR(data);
+            break;
+        }
+
+        poff = offset_in_page(q_pos);
+        chunk = min_t(size_t, PAGE_SIZE - poff, len);
+        chunk = min_t(size_t, chunk, dev->quantum - q_pos);
+        chunk = min_t(size_t, chunk, size - pos);
+
+        /* holes are spliced as the zero page */
+        pages[spd.nr_pages] = data ? virt_to_page(data + q_pos) : ZERO_PAGE(0);
+        get_page(pages[spd.nr_pages]);
+        partial[spd.nr_pages].offset = poff;
+        partial[spd.nr_pages].len = chunk;
+        spd.nr_pages++;
+
+        pos += chunk;
+        len -= chunk;
+    }
+    srcu_read_unlock(&scull_srcu, idx);
+    up_read(&dev->rwsem);
+
+    if (!spd.nr_pages)
         return retval;
+    /* pages the pipe had no room for are released through spd_release */
+    retval = splice_to_pipe(pipe, &spd);
+    if (retval > 0)
+        *ppos += retval;
+    return retval;
+}
+
+/* set up the per-file state of a bare or snapshot device */
+int scull_file_open(struct file *filp, struct scull_dev *dev)
+{
+    struct scull_file *sf = kmalloc(sizeof(*sf), GFP_KERNEL);
+
+    if (!sf)
+        return -ENOMEM;
+    sf->dev = dev;
+    spin_lock_init(&sf->lock);
+    sf->cur.pos = -1;
+    filp->private_data = sf;
+    return 0;
 }
 
 /* open the device file */
@@ -364,14 +1133,22 @@ int scull_open(struct inode *inode, struct file *filp)
 {
     /* device informatino */
     struct scull_dev *dev = container_of(inode->i_cdev, struct scull_dev, cdev);
-    filp->private_data = dev;
+    int err;
+
+    if (scull_file_open(filp, dev))
+        return -ENOMEM;
 
     /* trim the device length to 0 if opened write-only */
     if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-        if (mutex_lock_interruptible(&dev->lock))
-            return -ERESTARTSYS;
+        err = scull_lock_for_change(dev, filp, 1);
+        if (err) {
+            kfree(filp->private_data);
+            return err;
+        }
+        /* existing mappings of this node must fault in the new contents */
+        unmap_mapping_range(filp->f_mapping, 0, 0, 1);
         scull_trim(dev);
-        mutex_unlock(&dev->lock);
+        up_write(&dev->rwsem);
     }
     return 0;
 }
@@ -379,6 +1156,7 @@ int scull_open(struct inode *inode, struct file *filp)
 /* release the device file */
 int scull_release(struct inode *inode, struct file *filp)
 {
+    kfree(filp->private_data);
     return 0;
 }
 
@@ -388,7 +1166,7 @@ int scull_release(struct inode *inode, struct file *filp)
 
 long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-    int err = 0, tmp;
+    int err = 0, tmp, val;
     int retval = 0;
 
     /*
@@ -418,12 +1196,18 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         case SCULL_IOCSQUANTUM: /* set, arg points to the value */
             if (!capable(CAP_SYS_ADMIN))
                 return -EPERM;
-            retval = __get_user(scull_quantum, (int __user*)arg);
+            retval = __get_user(val, (int __user*)arg);
+            if (retval == 0 && !scull_quantum_ok(val))
+                retval = -EINVAL;
+            if (retval == 0)
+                scull_quantum = val;
             break;
 
         case SCULL_IOCTQUANTUM: /* tell, arg is the value */
             if (!capable(CAP_SYS_ADMIN))
                 return -EPERM;
+            if (!scull_quantum_ok(arg))
+                return -EINVAL;
             scull_quantum = arg;
             break;
 
@@ -438,14 +1222,20 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             if (!capable(CAP_SYS_ADMIN))
                 return -EPERM;
             tmp = scull_quantum;
-            retval = __get_user(scull_quantum, (int __user*)arg);
-            if (retval == 0)
+            retval = __get_user(val, (int __user*)arg);
+            if (retval == 0 && !scull_quantum_ok(val))
+                retval = -EINVAL;
+            if (retval == 0) {
+                scull_quantum = val;
                 retval = __put_user(tmp, (int __user*)arg);
+            }
             break;
 
         case SCULL_IOCHQUANTUM: /* shift: tell + query */
             if (!capable(CAP_SYS_ADMIN))
                 return -EPERM;
+            if (!scull_quantum_ok(arg))
+                return -EINVAL;
             tmp = scull_quantum;
             scull_quantum = arg;
             return tmp;
@@ -453,12 +1243,18 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         case SCULL_IOCSQSET:
             if (!capable(CAP_SYS_ADMIN))
                 return -EPERM;
-            retval = __get_user(scull_qset, (int __user*)arg);
+            retval = __get_user(val, (int __user*)arg);
+            if (retval == 0 && !scull_qset_ok(val))
+                retval = -EINVAL;
+            if (retval == 0)
+                scull_qset = val;
             break;
 
         case SCULL_IOCTQSET:
             if (!capable(CAP_SYS_ADMIN))
                 return -EPERM;
+            if (!scull_qset_ok(arg))
+                return -EINVAL;
             scull_qset = arg;
             break;
 
@@ -469,25 +1265,449 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             if (!capable(CAP_SYS_ADMIN))
                 return -EPERM;
             tmp = scull_qset;
-            retval = __get_user(scull_qset, (int __user*)arg);
-            if (retval == 0)
+            retval = __get_user(val, (int __user*)arg);
+            if (retval == 0 && !scull_qset_ok(val))
+                retval = -EINVAL;
+            if (retval == 0) {
+                scull_qset = val;
                 retval = __put_user(tmp, (int __user*)arg);
+            }
             break;
 
         case SCULL_IOCHQSET:
             if (!capable(CAP_SYS_ADMIN))
                 return -EPERM;
+            if (!scull_qset_ok(arg))
+                return -EINVAL;
             tmp = scull_qset;
             scull_qset = arg;
             return tmp;
+
+        default: /* numbers handled by the individual devices */
+            return -ENOTTY;
     }
 
     return retval;
 }
 
+/*
+** Free the quanta lying wholly inside [offset, offset + length) and zero
+** the partial ones at the edges, so that the range reads back as zeroes
+** but only live data keeps memory. Quantum sets left empty go as well.
+** The size of the device doesn't change.
+*/
+static int scull_punch_hole(struct file *filp, struct scull_dev *dev,
+                            u64 offset, u64 length)
+{
+    int quantum, qset, s_pos, q_pos, i;
+    int retval = 0;
+    unsigned long item, pos, end, next, set_end;
+    struct scull_qset *dptr;
+    void **data;
+
+    if (offset + length < offset)
+        return -EINVAL;
+    retval = scull_lock_for_change(dev, filp, 1);
+    if (retval)
+        return retval;
+
+    quantum = dev->quantum;
+    qset = dev->qset;
+    if (offset >= dev->size)
+        goto out;
+    pos = offset;
+    end = min_t(u64, offset + length, dev->size);
+
+    /* existing mappings of the range must see the hole */
+    unmap_mapping_range(filp->f_mapping, pos, end - pos, 1);
+
+    for (; pos < end; pos = next) {
+        item = scull_split(dev, pos, &s_pos, &q_pos);
+        set_end = (item + 1) * scull_itemsize(dev);
+
+        dptr = xa_load(dev->qsets, item);
+        if (!dptr) {
+            next = min(set_end, end);
+            continue;
+        }
+        next = min(pos - q_pos + quantum, end);
+        data = dptr->data;
+        if (data && data[s_pos]) {
+            if (q_pos == 0 && next - pos == quantum) {
+                if (scull_q_holds(data[s_pos]))
+                    scull_uncharge(dev, quantum);
+                scull_packed_forget(dev, data[s_pos]);
+                scull_put_quantum(quantum, data[s_pos]);
+                data[s_pos] = NULL;
+            } else if (scull_q_is_zero(data[s_pos])) {
+                /* reads as zeroes already */
+            } else if (scull_unpack_locked(dev, &data[s_pos]) &&
+                       scull_unshare_quantum(quantum, &data[s_pos])) {
+                memset(data[s_pos] + q_pos, 0, next - pos);
+            } else {
+                retval = -ENOMEM;
+                break;
+            }
+        }
+
+        /* leaving this qset: drop it if nothing is left in it */
+        if (next != set_end && next != end)
+            continue;
+        for (i = 0; data && i < qset && !data[i]; i++)
+            ;
+        if (!data || i == qset) {
+            xa_erase(dev->qsets, item);
+            scull_free_array(qset, data);
+            scull_free_qset(dptr);
+            dev->gen++;
+        }
+    }
+
+    out:
+        up_write(&dev->rwsem);
+        return retval;
+}
+
+/*
+** Lock two bare devices for writing, in address order so that copies
+** running in opposite directions can't deadlock. Neither may be in the
+** middle of a reshape; see scull_lock_for_change.
+*/
+static int scull_lock_pair(struct scull_dev *a, struct scull_dev *b,
+                           struct file *filp)
+{
+    int retval;
+
+    if (a == b)
+        return scull_lock_for_change(a, filp, 1);
+    if (a > b)
+        swap(a, b);
+    for (;;) {
+        retval = scull_reshape_wait(b, filp);
+        if (retval)
+            return retval;
+        retval = scull_lock_for_change(a, filp, 1);
+        if (retval)
+            return retval;
+        down_write_nested(&b->rwsem, SINGLE_DEPTH_NESTING);
+        if (!b->reshape)
+            return 0;
+        /* one started on b in between, wait for it again */
+        up_write(&b->rwsem);
+        up_write(&a->rwsem);
+    }
+}
+
+static void scull_unlock_pair(struct scull_dev *a, struct scull_dev *b)
+{
+    up_write(&a->rwsem);
+    if (a != b)
+        up_write(&b->rwsem);
+}
+
+/*
+** Copy "length" bytes at src_off of one bare device to dst_off of
+** another one, or of the same one if the ranges don't overlap. Where the
+** two devices have the same quantum and the ranges line up with whole
+** quanta, the quanta are shared instead of copied, and only get copied
+** once either side writes to them; the rest is memcpy()ed. Both devices
+** are locked for writing, which is short since sharing is cheap.
+** Returns the number of bytes copied; the copy stops at the end of the
+** source.
+*/
+static ssize_t scull_copy_range(struct file *dst_filp, struct file *src_filp,
+                                u64 src_off, u64 dst_off, u64 length)
+{
+    struct scull_dev *dst = scull_file_dev(dst_filp);
+    struct scull_dev *src = scull_file_dev(src_filp);
+    struct scull_qset *locked = NULL, *sdptr, *ddptr;
+    int quantum, s_pos, q_pos, d_s_pos, d_q_pos, fresh;
+    unsigned long item, d_item, pos, end, copied = 0, chunk;
+    void **in, **out, *q, *sdata, *ddata;
+    ssize_t retval;
+
+    retval = scull_lock_pair(src, dst, dst_filp);
+    if (retval)
+        return retval;
+    quantum = src->quantum; /* a reshape may just have changed it */
+
+    if (src_off >= src->size)
+        goto out;
+    if (dst_off >= SCULL_SIZE_MAX) {
+        retval = -EFBIG;
+        goto out;
+    }
+    length = min_t(u64, length, src->size - src_off);
+    length = min_t(u64, length, SCULL_SIZE_MAX - dst_off);
+    if (src == dst && src_off < dst_off + length && dst_off < src_off + length) {
+        retval = -EINVAL;
+        goto out;
+    }
+    pos = src_off;
+    end = src_off + length;
+
+    /* shared quanta must fault in again, to be copied on write */
+    unmap_mapping_range(src_filp->f_mapping, src_off, length, 1);
+    unmap_mapping_range(dst_filp->f_mapping, dst_off, length, 1);
+
+    for (; pos < end; pos += chunk, copied += chunk) {
+        item = scull_split(src, pos, &s_pos, &q_pos);
+        d_item = scull_split(dst, dst_off + copied, &d_s_pos, &d_q_pos);
+
+        if (dst->quantum != quantum || q_pos || d_q_pos || end - pos < quantum) {
+            /* no whole quanta to share here, copy the bytes */
+            chunk = min_t(unsigned long, quantum - q_pos, dst->quantum - d_q_pos);
+            chunk = min(chunk, end - pos);
+            fresh = scull_slot_empty(xa_load(dst->qsets, d_item), d_s_pos);
+            ddata = scull_quantum_for_write(dst, d_item, d_s_pos, &locked);
+            if (IS_ERR(ddata)) {
+                retval = PTR_ERR(ddata);
+                goto fail;
+            }
+            /*
+            ** Not scull_lookup_quantum: its unpacking takes the qset lock,
+            ** which may be the one just taken for dst. Both devices are
+            ** locked for writing, so the slot can be unpacked in place.
+            */
+            sdptr = xa_load(src->qsets, item);
+            in = sdptr && sdptr->data ? &sdptr->data[s_pos] : NULL;
+            if (in && scull_q_is_packed(*in) && !scull_unpack_locked(src, in))
+                goto nomem;
+            sdata = in ? scull_q_data(*in) : NULL;
+            if (sdata)
+                memcpy(ddata + d_q_pos, sdata + q_pos, chunk);
+            else
+                memset(ddata + d_q_pos, 0, chunk);
+            scull_note_fill(dst, fresh, dst_off + copied, chunk);
+            continue;
+        }
+
+        chunk = quantum;
+        sdptr = xa_load(src->qsets, item);
+        in = sdptr && sdptr->data ? &sdptr->data[s_pos] : NULL;
+        if (!in || !*in) {
+            /* a hole in the source punches one in the destination */
+            ddptr = xa_load(dst->qsets, d_item);
+            if (ddptr && ddptr->data) {
+                if (scull_q_holds(ddptr->data[d_s_pos]))
+                    scull_uncharge(dst, quantum);
+                scull_packed_forget(dst, ddptr->data[d_s_pos]);
+                scull_put_quantum(quantum, ddptr->data[d_s_pos]);
+                ddptr->data[d_s_pos] = NULL;
+            }
+            continue;
+        }
+        ddptr = scull_follow(dst, d_item);
+        out = ddptr ? scull_get_slot(dst, ddptr, d_s_pos) : NULL;
+        if (!out)
+            goto nomem;
+        if (scull_q_is_packed(*in) && !scull_unpack_locked(src, in))
+            goto nomem;
+        /* zero markers need no sharing, they are copied as they are */
+        if (scull_q_holds(*in) && !scull_q_holds(*out) &&
+            scull_charge(dst, quantum)) {
+            retval = -ENOSPC;
+            goto fail;
+        }
+        q = scull_q_is_zero(*in) ? SCULL_Q_ZERO : scull_share_quantum(quantum, in);
+        if (!q) {
+            if (!scull_q_holds(*out))
+                scull_uncharge(dst, quantum);
+            goto nomem;
+        }
+        if (!scull_q_holds(q) && scull_q_holds(*out))
+            scull_uncharge(dst, quantum);
+        if (scull_q_holds(q))
+            scull_note_fill(dst, !*out, dst_off + copied, quantum);
+        scull_packed_forget(dst, *out);
+        scull_put_quantum(quantum, *out);
+        smp_store_release(out, q);
+    }
+    goto done;
+
+    nomem:
+        retval = -ENOMEM;
+    fail:
+        if (retval == -ENOMEM)
+            scull_stat_inc(&dst->stats, alloc_failures);
+    done:
+        if (locked)
+            mutex_unlock(&locked->lock);
+        if (copied) {
+            scull_extend_size(dst, dst_off + copied);
+            retval = copied;
+        }
+    out:
+        scull_unlock_pair(src, dst);
+        return retval;
+}
+
+/*
+** ioctls that act on a single bare device. Everything else is handed
+** to scull_ioctl, which is shared with the other scull flavours.
+*/
+static long scull_dev_ioctl(struct file *filp, unsigned int cmd,
+                            unsigned long arg)
+{
+    struct scull_dev *dev = scull_file_dev(filp);
+    struct scull_copy_range copy;
+    struct scull_range range;
+    struct scull_numa numa;
+    struct scull_geometry geom;
+    struct file *src;
+    long retval;
+    u64 budget;
+
+    switch (cmd) {
+        case SCULL_IOCPUNCH: /* set, arg points to the range */
+            if (!(filp->f_mode & FMODE_WRITE))
+                return -EBADF;
+            if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+                return -EFAULT;
+            return scull_punch_hole(filp, dev, range.offset, range.length);
+
+        case SCULL_IOCCOPY: /* set, arg points to the request */
+            if (!(filp->f_mode & FMODE_WRITE))
+                return -EBADF;
+            if (copy_from_user(&copy, (void __user *)arg, sizeof(copy)))
+                return -EFAULT;
+            if (copy.src_fd < 0 || copy.src_fd > INT_MAX)
+                return -EBADF;
+            src = fget(copy.src_fd);
+            if (!src)
+                return -EBADF;
+            if (src->f_op->unlocked_ioctl != scull_dev_ioctl)
+                retval = -EINVAL; /* not a bare scull device */
+            else if (!(src->f_mode & FMODE_READ))
+                retval = -EBADF;
+            else
+                retval = scull_copy_range(filp, src, copy.src_offset,
+                                          copy.dst_offset, copy.length);
+            fput(src);
+            return retval;
+
+        case SCULL_IOCSNAP: /* query, returns the snapshot number */
+            if (!(filp->f_mode & FMODE_READ))
+                return -EBADF;
+            return scull_snap_take(filp, dev);
+
+        case SCULL_IOCSBUDGET: /* set, arg points to the value */
+            if (!capable(CAP_SYS_ADMIN))
+                return -EPERM;
+            if (get_user(budget, (u64 __user *)arg))
+                return -EFAULT;
+            WRITE_ONCE(dev->budget, budget);
+            return 0;
+
+        case SCULL_IOCGBUDGET: /* get, arg points to the result */
+            budget = READ_ONCE(dev->budget);
+            return put_user(budget, (u64 __user *)arg);
+
+        case SCULL_IOCSNUMA: /* set, arg points to the policy */
+            if (!(filp->f_mode & FMODE_WRITE))
+                return -EBADF;
+            if (copy_from_user(&numa, (void __user *)arg, sizeof(numa)))
+                return -EFAULT;
+            return scull_numa_set(dev, &numa);
+
+        case SCULL_IOCGNUMA: /* get, arg points to the result */
+            scull_numa_get(dev, &numa);
+            if (copy_to_user((void __user *)arg, &numa, sizeof(numa)))
+                return -EFAULT;
+            return 0;
+
+        case SCULL_IOCMIGRATE: /* tell, arg is the node */
+            if (!(filp->f_mode & FMODE_WRITE))
+                return -EBADF;
+            if (arg > INT_MAX)
+                return -EINVAL;
+            return scull_migrate(filp, dev, arg);
+
+        case SCULL_IOCSGEOM: /* set, arg points to the geometry */
+            if (!(filp->f_mode & FMODE_WRITE))
+                return -EBADF;
+            if (copy_from_user(&geom, (void __user *)arg, sizeof(geom)))
+                return -EFAULT;
+            return scull_reshape_start(filp, dev, &geom);
+
+        case SCULL_IOCGGEOM: /* get, arg points to the result */
+            scull_reshape_get(dev, &geom);
+            if (copy_to_user((void __user *)arg, &geom, sizeof(geom)))
+                return -EFAULT;
+            return 0;
+    }
+
+    return scull_ioctl(filp, cmd, arg);
+}
+
+/*
+** SEEK_DATA and SEEK_HOLE, at quantum granularity: an allocated quantum
+** is data even if it holds zeroes, and the end of the device is a hole.
+*/
+static loff_t scull_seek_data_hole(struct scull_dev *dev, loff_t off,
+                                   int whence)
+{
+    int quantum, qset, s_pos, q_pos;
+    unsigned long item, index, size;
+    struct scull_qset *dptr;
+    loff_t pos = off;
+    u64 itemsize;
+    void **data;
+
+    if (down_read_killable(&dev->rwsem))
+        return -ERESTARTSYS;
+
+    quantum = dev->quantum;
+    qset = dev->qset;
+    itemsize = scull_itemsize(dev);
+    size = smp_load_acquire(&dev->size);
+    /* lseek(2): past the end there is neither data nor a hole */
+    if (off >= size) {
+        up_read(&dev->rwsem);
+        return -ENXIO;
+    }
+
+    while (pos < size) {
+        item = scull_split(dev, pos, &s_pos, &q_pos);
+
+        dptr = xa_load(dev->qsets, item);
+        if (!dptr && whence == SEEK_DATA) {
+            /* skip straight to the next qset there is */
+            index = item;
+            if (!xa_find(dev->qsets, &index, ULONG_MAX, XA_PRESENT))
+                break;
+            pos = index * itemsize;
+            continue;
+        }
+        data = dptr ? smp_load_acquire(&dptr->data) : NULL;
+        if (!data) {
+            if (whence == SEEK_HOLE)
+                goto out;
+            pos = (item + 1) * itemsize;
+            continue;
+        }
+        for (; s_pos < qset; s_pos++) {
+            /* stop at the first quantum of the kind we are looking for */
+            if (!!smp_load_acquire(&data[s_pos]) == (whence == SEEK_DATA)) {
+                pos = max_t(loff_t, pos, item * itemsize + (u64)s_pos * quantum);
+                goto out;
+            }
+        }
+        pos = (item + 1) * itemsize;
+    }
+    pos = size; /* nothing found before the end */
+
+    out:
+        up_read(&dev->rwsem);
+        if (pos < size)
+            return pos;
+        /* no data after off; the end counts as a hole */
+        return whence == SEEK_DATA ? -ENXIO : size;
+}
+
 loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 {
-    struct scull_dev *dev = filp->private_data;
+    struct scull_dev *dev = scull_file_dev(filp);
     loff_t newpos;
 
     switch (whence) {
@@ -496,41 +1716,152 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
             break;
 
         case 1: /* SEEK_CUR */
-            newpos = filp->f_pos + off;
+            if (check_add_overflow(filp->f_pos, off, &newpos))
+                return -EINVAL;
             break;
 
         case 2: /* SEEK_END */
-            newpos = dev->size + off;
+            if (check_add_overflow((loff_t)READ_ONCE(dev->size), off, &newpos))
+                return -EINVAL;
+            break;
+
+        case SEEK_DATA:
+        case SEEK_HOLE:
+            if (off < 0)
+                return -ENXIO;
+            newpos = scull_seek_data_hole(dev, off, whence);
+            if (newpos < 0)
+                return newpos;
             break;
 
         default: /* can't happen */
             return -EINVAL;
     }
-    if (newpos < 0) return -EINVAL;
+    if (newpos < 0 || newpos > MAX_LFS_FILESIZE) return -EINVAL;
     filp->f_pos = newpos;
     return newpos;
 }
 
+/*
+** mmap() support, only for devices whose quanta are page-backed.
+** Pages are resolved through the qset structure at fault time.
+*/
+static vm_fault_t scull_vma_fault(struct vm_fault *vmf)
+{
+    struct scull_dev *dev = vmf->vma->vm_private_data;
+    loff_t off = (loff_t)vmf->pgoff << PAGE_SHIFT;
+    struct scull_qset *locked = NULL;
+    unsigned long item;
+    int quantum, s_pos, q_pos;
+    void *data;
+    vm_fault_t retval = VM_FAULT_SIGBUS;
+    /*
+    ** Only stores through a shared mapping reach the device. A private
+    ** one gets a copy of the page from the core on a write fault
+    ** (do_cow_fault), so it is served like a read here.
+    */
+    int store = (vmf->flags & FAULT_FLAG_WRITE) &&
+                (vmf->vma->vm_flags & VM_SHARED);
+
+    if (off >= SCULL_SIZE_MAX)
+        return retval;
+    /* holes get filled, so this waits for a reshape too */
+    if (scull_lock_for_change(dev, NULL, 0))
+        return retval;
+    quantum = dev->quantum;
+
+    /* the geometry may have changed since mmap() was called */
+    if (!scull_quantum_paged(quantum))
+        goto out;
+    /* reads past the end have nothing to map, stores extend the device */
+    if (off >= READ_ONCE(dev->size) && !store)
+        goto out;
+
+    item = scull_split(dev, off, &s_pos, &q_pos);
+
+    /*
+     * A shared mapping can't be backed by the zero page, so holes are
+     * filled on any fault, not just on writes.
+     */
+    data = scull_quantum_for_write(dev, item, s_pos, &locked);
+    if (IS_ERR(data)) {
+        retval = PTR_ERR(data) == -ENOSPC ? VM_FAULT_SIGBUS : VM_FAULT_OOM;
+        goto out;
+    }
+
+    vmf->page = virt_to_page(data + q_pos);
+    get_page(vmf->page);
+    if (store)
+        scull_extend_size(dev, off + PAGE_SIZE);
+    retval = 0;
+
+    out:
+        if (locked)
+            mutex_unlock(&locked->lock);
+        up_read(&dev->rwsem);
+        return retval;
+}
+
+static const struct vm_operations_struct scull_vm_ops = {
+    .fault = scull_vma_fault,
+};
+
+static int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct scull_dev *dev = scull_file_dev(filp);
+
+    /* kmalloc'd quanta don't line up with pages */
+    if (!scull_quantum_paged(dev->quantum))
+        return -ENODEV;
+
+    /*
+    ** A carved quantum is a piece of a PMD-sized compound page, and the
+    ** fault path would map the whole of that with one PMD, neighbours
+    ** and all, if the vma allowed huge pages. Map page by page only.
+    */
+    vm_flags_set(vma, VM_NOHUGEPAGE);
+    vma->vm_ops = &scull_vm_ops;
+    vma->vm_private_data = dev;
+    return 0;
+}
+
 struct file_operations scull_fops = {
     .owner = THIS_MODULE,
     .llseek = scull_llseek,
-    .read = scull_read,
-    .write = scull_write,
-    .unlocked_ioctl = scull_ioctl,
+    .read_iter = scull_read_iter,
+    .write_iter = scull_write_iter,
+    .splice_read = scull_splice_read,
+    .splice_write = iter_file_splice_write,
+    .mmap = scull_mmap,
+    .unlocked_ioctl = scull_dev_ioctl,
     .open = scull_open,
     .release = scull_release,
 };
 
+/*
+** Same as scull_fops, but read() and write() go through the original
+** one-quantum-at-a-time methods. Filled in at init time.
+*/
+static struct file_operations scull_legacy_fops;
+
 void scull_cleanup_module(void)
 {
     int i;
     dev_t devno = MKDEV(scull_major, scull_minor);
 
-    /* get rid of char dev entries */
+    /* nothing to shrink any more */
+    scull_budget_cleanup();
+
+    /* get rid of char dev entries; the trims proceed in parallel */
     if (scull_devices) {
         for (i = 0; i < scull_nr_devs; i++) {
-            scull_trim(scull_devices + i);
             cdev_del(&scull_devices[i].cdev);
+            scull_compress_dev_cleanup(scull_devices + i);
+            scull_reshape_dev_cleanup(scull_devices + i);
+            scull_pool_cleanup(&scull_devices[i].pool);
+            scull_qsets_free(scull_devices + i);
+            scull_carve_cleanup(&scull_devices[i].carve);
+            scull_stats_cleanup(&scull_devices[i].stats);
         }
         kfree(scull_devices);
    }
@@ -544,14 +1875,27 @@ void scull_cleanup_module(void)
 
     /* cleanup friendly devices */
     scull_p_cleanup();
+    scull_snap_cleanup();
+
+    scull_stats_root_cleanup();
+
+    /* wait for the deferred frees before the caches go away */
+    if (scull_trim_wq)
+        destroy_workqueue(scull_trim_wq);
+    scull_trim_wq = NULL;
+    srcu_barrier(&scull_srcu);
+    scull_compress_cleanup();
+    scull_alloc_cleanup();
 }
 
 static void scull_setup_cdev(struct scull_dev *dev, int index)
 {
     int err, devno = MKDEV(scull_major, scull_minor + index);
-    cdev_init(&dev->cdev, &scull_fops);
+    struct file_operations *fops = scull_legacy_rw ? &scull_legacy_fops : &scull_fops;
+
+    cdev_init(&dev->cdev, fops);
     dev->cdev.owner = THIS_MODULE;
-    dev->cdev.ops = &scull_fops;
+    dev->cdev.ops = fops;
     err = cdev_add(&dev->cdev, devno, 1);
     /* Failure */
     if (err)
@@ -562,6 +1906,7 @@ int scull_init_module(void)
 {
     int result, i;
     dev_t dev = 0;
+    char name[16];
 
     if (scull_major) {
         dev = MKDEV(scull_major, scull_minor);
@@ -575,6 +1920,20 @@ int scull_init_module(void)
         printk(KERN_WARNING "scull: can't get major %d\n", scull_major);
         return result;
     }
+    if (!scull_quantum_ok(scull_quantum) || !scull_qset_ok(scull_qset)) {
+        printk(KERN_WARNING "scull: bad geometry %d x %d\n", scull_quantum, scull_qset);
+        unregister_chrdev_region(dev, scull_nr_devs);
+        return -EINVAL;
+    }
+
+    result = scull_alloc_init();
+    if (result) {
+        unregister_chrdev_region(dev, scull_nr_devs);
+        return result;
+    }
+    /* without it scull_trim just frees synchronously */
+    scull_trim_wq = alloc_workqueue("scull_trim", WQ_UNBOUND, 0);
+    scull_compress_init();
 
     /* allocate devices */
     scull_devices = kmalloc(scull_nr_devs * sizeof(struct scull_dev), GFP_KERNEL);
@@ -584,16 +1943,50 @@ int scull_init_module(void)
     }
     memset(scull_devices, 0, scull_nr_devs * sizeof(struct scull_dev));
 
+    /* statistics and xarrays, set up before any device goes live */
+    scull_stats_root_init();
+    for (i = 0; i < scull_nr_devs; i++) {
+        snprintf(name, sizeof(name), "scull%d", i);
+        scull_devices[i].qsets = scull_qsets_alloc();
+        if (!scull_devices[i].qsets ||
+            scull_stats_init(&scull_devices[i].stats, name)) {
+            scull_qsets_free(scull_devices + i);
+            while (--i >= 0) {
+                scull_stats_cleanup(&scull_devices[i].stats);
+                scull_qsets_free(scull_devices + i);
+            }
+            kfree(scull_devices);
+            scull_devices = NULL;
+            result = -ENOMEM;
+            goto fail;
+        }
+    }
+
+    scull_legacy_fops = scull_fops;
+    scull_legacy_fops.read = scull_read;
+    scull_legacy_fops.write = scull_write;
+
     /* initialise devices */
     for (i = 0 ; i < scull_nr_devs; i++) {
         scull_devices[i].quantum = scull_quantum;
         scull_devices[i].qset = scull_qset;
-        mutex_init(&scull_devices[i].lock);
+        scull_devices[i].budget = scull_dev_budget;
+        scull_devices[i].numa_node = NUMA_NO_NODE;
+        scull_devices[i].adaptive = scull_adaptive;
+        scull_devices[i].stats.show = scull_dev_show;
+        init_rwsem(&scull_devices[i].rwsem);
+        scull_pool_init(&scull_devices[i].pool, scull_quantum, scull_pool_quanta);
+        scull_carve_init(&scull_devices[i].carve);
+        scull_compress_dev_init(scull_devices + i);
+        scull_reshape_dev_init(scull_devices + i);
         scull_setup_cdev(&scull_devices[i], i);
     }
 
+    scull_budget_init();
+
     dev = MKDEV(scull_major, scull_minor + scull_nr_devs);
     dev += scull_p_init(dev);
+    dev += scull_snap_init(dev);
 
 
 #ifdef SCULL_DEBUG
@@ -0,0 +1,141 @@
+/*
+ * numa.c -- where the quanta of the bare devices live
+ *
+ * By default a quantum is allocated on the node of the task that first
+ * writes it, which is a poor fit for a device that is filled by one
+ * socket and read by another. SCULL_IOCSNUMA gives a device another
+ * placement policy: interleaved over the nodes that have memory, or
+ * bound to one node. SCULL_IOCMIGRATE moves the quanta a device
+ * already has, and the stats file shows how many bytes of quanta scull
+ * has on each node.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/nodemask.h>
+#include <linux/seq_file.h>
+
+#include "scull.h"
+
+/* the node a new quantum of dev should go to, or NUMA_NO_NODE for local */
+int scull_dev_node(struct scull_dev *dev)
+{
+    int node;
+
+    switch (READ_ONCE(dev->numa_policy)) {
+        case SCULL_NUMA_INTERLEAVE:
+            /* racy, but two writers picking the same node is harmless */
+            node = next_node_in(READ_ONCE(dev->numa_next), node_states[N_MEMORY]);
+            WRITE_ONCE(dev->numa_next, node);
+            return node;
+        case SCULL_NUMA_BIND:
+            return READ_ONCE(dev->numa_node);
+    }
+    return NUMA_NO_NODE;
+}
+
+static int scull_node_valid(int node)
+{
+    return node >= 0 && node < MAX_NUMNODES && node_state(node, N_MEMORY);
+}
+
+int scull_numa_set(struct scull_dev *dev, struct scull_numa *numa)
+{
+    switch (numa->policy) {
+        case SCULL_NUMA_BIND:
+            if (!scull_node_valid(numa->node))
+                return -EINVAL;
+            break;
+        case SCULL_NUMA_LOCAL:
+        case SCULL_NUMA_INTERLEAVE:
+            numa->node = NUMA_NO_NODE;
+            break;
+        default:
+            return -EINVAL;
+    }
+    WRITE_ONCE(dev->numa_node, numa->node);
+    WRITE_ONCE(dev->numa_policy, numa->policy);
+    return 0;
+}
+
+void scull_numa_get(struct scull_dev *dev, struct scull_numa *numa)
+{
+    numa->policy = READ_ONCE(dev->numa_policy);
+    numa->node = READ_ONCE(dev->numa_node);
+}
+
+static int scull_q_node(void *q)
+{
+    if (scull_q_is_packed(q))
+        return page_to_nid(virt_to_page(scull_q_packed(q)));
+    return page_to_nid(virt_to_page(scull_q_data(q)));
+}
+
+/*
+** Move the private quanta of dev that aren't on "node" there. Shared
+** quanta may be in use by other devices and are left where they are,
+** as are compressed ones. Returns the number of quanta moved; running
+** out of memory on the node stops the move early.
+*/
+long scull_migrate(struct file *filp, struct scull_dev *dev, int node)
+{
+    struct scull_qset *dptr;
+    unsigned long index;
+    long moved = 0;
+    void *q, *data;
+    int i;
+
+    if (!scull_node_valid(node))
+        return -EINVAL;
+    moved = scull_lock_for_change(dev, filp, 1);
+    if (moved)
+        return moved;
+
+    /* mappings must fault the new pages in */
+    unmap_mapping_range(filp->f_mapping, 0, 0, 1);
+
+    xa_for_each(dev->qsets, index, dptr) {
+        for (i = 0; dptr->data && i < dev->qset; i++) {
+            q = dptr->data[i];
+            if (!scull_q_holds(q) || scull_q_is_shared(q) || scull_q_is_packed(q))
+                continue;
+            if (scull_q_node(q) == node)
+                continue;
+            data = scull_alloc_quantum_node(dev->quantum, node);
+            if (!data) {
+                scull_stat_inc(&dev->stats, alloc_failures);
+                if (!moved)
+                    moved = -ENOMEM;
+                goto out;
+            }
+            memcpy(data, q, dev->quantum);
+            /* readers are locked out, and pipes hold their own page refs */
+            dptr->data[i] = data;
+            scull_free_quantum(dev->quantum, q);
+            moved++;
+        }
+        cond_resched();
+    }
+
+    out:
+        up_write(&dev->rwsem);
+        return moved;
+}
+
+/*
+** Per-node usage, for the stats file. Kept as quanta are allocated and
+** freed (migrating is both), so it is for all of scull rather than this
+** device: a quantum may be shared by several. Pooled quanta count,
+** compressed ones don't.
+*/
+void scull_numa_show(struct seq_file *s, struct scull_stats *st)
+{
+    int node;
+
+    for_each_node_state(node, N_MEMORY)
+        seq_printf(s, "scull_node%d_bytes: %ld\n", node,
+                   atomic_long_read(&scull_node_used[node]));
+}
@@ -30,32 +30,41 @@
 #include <linux/sched.h>
 #include <linux/sched/signal.h>
 #include <linux/seq_file.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 
 #include "scull.h"
 #include "proc_ops_version.h"
+#include "splice_version.h"
+#include "scull_trace.h"
 
 struct scull_pipe {
     wait_queue_head_t inq, outq; /* read and write queues */
-    char *buffer, *end; /* begin of buf, end of buf */
-    int buffersize; /* used in pointer arithmetic */
-    char *rp, *wp; /* read & write pointers */
+    char *buffer; /* the ring */
+    unsigned int buffersize; /* a power of two, used to mask rp and wp */
+    unsigned int rp, wp; /* free-running read & write indices */
     int nreaders, nwriters; /* number of openings for r/w */
     struct fasync_struct *async_queue; /* async readers */
     struct mutex lock;
+    struct scull_stats stats;
     struct cdev cdev;
 };
 
 static int scull_p_nr_devs = SCULL_P_NR_DEVS; /* number of pipe devices */
 int scull_p_buffer = SCULL_P_BUFFER; /* buffer size */
+static int scull_p_spsc = 0; /* lockless single-producer/single-consumer mode */
 dev_t scull_p_devno; /* first device number */
 
 module_param(scull_p_nr_devs, int, 0);
 module_param(scull_p_buffer, int, 0);
+module_param(scull_p_spsc, int, 0);
 
 static struct scull_pipe *scull_p_devices;
 
 static int scull_p_fasync(int fd, struct file *filp, int mode);
-static int spacefree(struct scull_pipe *dev);
+static unsigned int spacefree(struct scull_pipe *dev);
 
 /* open & close */
 static int scull_p_open(struct inode *inode, struct file *filp)
@@ -68,21 +77,31 @@ static int scull_p_open(struct inode *inode, struct file *filp)
     if (mutex_lock_interruptible(&dev->lock))
         return -ERESTARTSYS;
 
+    /* the lockless mode only works with one reader and one writer */
+    if (scull_p_spsc && (((filp->f_mode & FMODE_READ) && dev->nreaders) ||
+                         ((filp->f_mode & FMODE_WRITE) && dev->nwriters))) {
+        mutex_unlock(&dev->lock);
+        return -EBUSY;
+    }
+
     if (!dev->buffer) {
         /* allocate the buffer */
-        dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
+        dev->buffer = kvmalloc(dev->buffersize, GFP_KERNEL);
         if (!dev->buffer) {
+            scull_stat_inc(&dev->stats, alloc_failures);
             mutex_unlock(&dev->lock);
             return -ENOMEM;
         }
+        /*
+         * r&w from the beginning; only reset with a fresh buffer, so a
+         * new opener doesn't throw away (or race with) buffered data
+         */
+        dev->rp = dev->wp = 0;
     }
-    dev->buffersize = scull_p_buffer;
-    dev->end = dev->buffer + dev->buffersize;
-    dev->rp = dev->wp = dev->buffer; /* r&w from the beginning */
 
     if (filp->f_mode & FMODE_READ)
         dev->nreaders++;
-    else if (filp->f_mode & FMODE_WRITE)
+    if (filp->f_mode & FMODE_WRITE)
         dev->nwriters++;
     mutex_unlock(&dev->lock);
 
@@ -98,47 +117,156 @@ static int scull_p_release(struct inode *inode, struct file *filp)
     mutex_lock(&dev->lock);
     if (filp->f_mode & FMODE_READ)
         dev->nreaders--;
-    else if (filp->f_mode & FMODE_WRITE)
+    if (filp->f_mode & FMODE_WRITE)
         dev->nwriters--;
     if (dev->nreaders + dev->nwriters == 0) {
-        kfree(dev->buffer);
+        kvfree(dev->buffer);
         dev->buffer = NULL;
     }
     mutex_unlock(&dev->lock);
     return 0;
 }
 
-/* read & write */
-static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/*
+** The ring is a power of two in size and rp/wp are free-running
+** indices, masked only when the buffer is addressed. wp - rp is the
+** number of bytes buffered, so the whole buffer can be used and no
+** division is needed. A transfer that crosses the end of the buffer
+** copies both halves in one call.
+*/
+static size_t scull_p_copy_out(struct scull_pipe *dev, unsigned int rp,
+                               size_t count, struct iov_iter *to)
 {
-    struct scull_pipe *dev = filp->private_data;
+    unsigned int off = rp & (dev->buffersize - 1);
+    size_t first = min_t(size_t, count, dev->buffersize - off);
+    size_t copied;
+
+    copied = copy_to_iter(dev->buffer + off, first, to);
+    if (copied == first && count > first) /* wrapped */
+        copied += copy_to_iter(dev->buffer, count - first, to);
+    return copied;
+}
+
+static size_t scull_p_copy_in(struct scull_pipe *dev, unsigned int wp,
+                              size_t count, struct iov_iter *from)
+{
+    unsigned int off = wp & (dev->buffersize - 1);
+    size_t first = min_t(size_t, count, dev->buffersize - off);
+    size_t copied;
+
+    copied = copy_from_iter(dev->buffer + off, first, from);
+    if (copied == first && count > first) /* wrapped */
+        copied += copy_from_iter(dev->buffer, count - first, from);
+    return copied;
+}
+
+/*
+** Lockless single-producer/single-consumer fast path.
+** Only the reader moves rp and only the writer moves wp; each side
+** publishes its index with a release store and reads the other's with
+** an acquire load, so the data copied before a store is visible to the
+** other side after its load. The wait queues are only touched when the
+** other side may actually be asleep: wq_has_sleeper() supplies the
+** barrier that pairs with the sleeper's prepare_to_wait().
+*/
+static ssize_t scull_p_read_spsc(struct scull_pipe *dev, struct file *filp,
+                                 struct iov_iter *to)
+{
+    size_t count = iov_iter_count(to);
+    unsigned int rp = dev->rp;
+    unsigned int wp;
+    u64 slept;
+
+    while ((wp = smp_load_acquire(&dev->wp)) == rp) { /* nothing to read */
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        PDEBUG("'%s' reading: going to sleep\n", current->comm);
+        scull_stat_inc(&dev->stats, sleeps);
+        trace_scull_p_sleep(MINOR(dev->cdev.dev), 0, count);
+        slept = local_clock();
+        if (wait_event_interruptible(dev->inq, smp_load_acquire(&dev->wp) != rp))
+            return -ERESTARTSYS;
+        trace_scull_p_wake(MINOR(dev->cdev.dev), 0, count, local_clock() - slept);
+    }
+    count = min_t(size_t, count, wp - rp);
+    count = scull_p_copy_out(dev, rp, count, to);
+    if (!count)
+        return -EFAULT;
+    smp_store_release(&dev->rp, rp + count);
+
+    if (wq_has_sleeper(&dev->outq))
+        wake_up_interruptible(&dev->outq);
+    return count;
+}
+
+static ssize_t scull_p_write_spsc(struct scull_pipe *dev, struct file *filp,
+                                  struct iov_iter *from)
+{
+    size_t count = iov_iter_count(from);
+    unsigned int wp = dev->wp;
+    unsigned int rp;
+    u64 slept;
+
+    while (wp - (rp = smp_load_acquire(&dev->rp)) == dev->buffersize) { /* full */
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        PDEBUG("'%s' writing: going to sleep\n", current->comm);
+        scull_stat_inc(&dev->stats, sleeps);
+        trace_scull_p_sleep(MINOR(dev->cdev.dev), 1, count);
+        slept = local_clock();
+        if (wait_event_interruptible(dev->outq,
+                    wp - smp_load_acquire(&dev->rp) != dev->buffersize))
+            return -ERESTARTSYS;
+        trace_scull_p_wake(MINOR(dev->cdev.dev), 1, count, local_clock() - slept);
+    }
+    count = min_t(size_t, count, dev->buffersize - (wp - rp));
+    count = scull_p_copy_in(dev, wp, count, from);
+    if (!count)
+        return -EFAULT;
+    smp_store_release(&dev->wp, wp + count);
+
+    if (wq_has_sleeper(&dev->inq))
+        wake_up_interruptible(&dev->inq);
+    if (dev->async_queue)
+        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+    return count;
+}
+
+/* read & write, the locked versions */
+static ssize_t scull_p_read_locked(struct scull_pipe *dev, struct file *filp,
+                                   struct iov_iter *to)
+{
+    size_t count = iov_iter_count(to);
+    u64 start = local_clock();
+    u64 slept;
 
     if (mutex_lock_interruptible(&dev->lock))
         return -ERESTARTSYS;
+    scull_stat_lock_wait(&dev->stats, start);
 
     while (dev->rp == dev->wp) { /* nothing to read */
         mutex_unlock(&dev->lock);
         if (filp->f_flags & O_NONBLOCK)
             return -EAGAIN;
         PDEBUG("'%s' reading: going to sleep\n", current->comm);
+        scull_stat_inc(&dev->stats, sleeps);
+        trace_scull_p_sleep(MINOR(dev->cdev.dev), 0, count);
+        slept = local_clock();
         if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
             return -ERESTARTSYS;
+        trace_scull_p_wake(MINOR(dev->cdev.dev), 0, count, local_clock() - slept);
         /* loop but first reacquire the lock */
         if (mutex_lock_interruptible(&dev->lock))
             return -ERESTARTSYS;
     }
-    /* data available, return something */
-    if (dev->wp > dev->rp)
-        count = min(count, (size_t)(dev->wp - dev->rp));
-    else /* write pointer has wrapped, return data up to dev->end */
-        count = min(count, (size_t)(dev->end - dev->rp));
-    if (copy_to_user(buf, dev->rp, count)) {
+    /* data available, return all of it, wrapped or not */
+    count = min_t(size_t, count, dev->wp - dev->rp);
+    count = scull_p_copy_out(dev, dev->rp, count, to);
+    if (!count) {
         mutex_unlock(&dev->lock);
         return -EFAULT;
     }
     dev->rp += count;
-    if (dev->rp == dev->end)
-        dev->rp = dev->buffer; /* wrapped */
     mutex_unlock(&dev->lock);
 
     /* awake any writers and return */
@@ -149,19 +277,25 @@ static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count, l
 
 /* wait for space for writing */
 /* caller must hold the the device's mutex */
-static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
+static int scull_getwritespace(struct scull_pipe *dev, struct file *filp,
+                               size_t count)
 {
     while (spacefree(dev) == 0) { /* device full */
         DEFINE_WAIT(wait);
+        u64 slept;
 
         mutex_unlock(&dev->lock);
         if (filp->f_flags & O_NONBLOCK)
             return -EAGAIN;
         PDEBUG("'%s' writing: going to sleep\n", current->comm);
+        scull_stat_inc(&dev->stats, sleeps);
+        trace_scull_p_sleep(MINOR(dev->cdev.dev), 1, count);
+        slept = local_clock();
         prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
         if (spacefree(dev) == 0)
             schedule();
         finish_wait(&dev->outq, &wait);
+        trace_scull_p_wake(MINOR(dev->cdev.dev), 1, count, local_clock() - slept);
         if (signal_pending(current))
             return -ERESTARTSYS;
         if (mutex_lock_interruptible(&dev->lock))
@@ -171,40 +305,36 @@ static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
 }
 
 /* free space in the buffer */
-static int spacefree(struct scull_pipe *dev)
+static unsigned int spacefree(struct scull_pipe *dev)
 {
-    if (dev->rp == dev->wp)
-        return dev->buffersize - 1;
-    return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+    return dev->buffersize - (dev->wp - dev->rp);
 }
 
 
-static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+static ssize_t scull_p_write_locked(struct scull_pipe *dev, struct file *filp,
+                                    struct iov_iter *from)
 {
-    struct scull_pipe *dev = filp->private_data;
+    size_t count = iov_iter_count(from);
+    u64 start = local_clock();
     int result;
 
     if (mutex_lock_interruptible(&dev->lock))
         return -ERESTARTSYS;
+    scull_stat_lock_wait(&dev->stats, start);
 
-    result = scull_getwritespace(dev, filp);
+    result = scull_getwritespace(dev, filp, count);
     if (result)
         return result; /* mutex released by scull_getwritespace */
 
-    /* space available, accept data */
-    count = min(count, (size_t)spacefree(dev));
-    if (dev->wp >= dev->rp)
-        count = min(count, (size_t)(dev->end - dev->wp)); /* to end-of-buf */
-    else /* write pointer wrapped, fill up to rp-1 */
-        count = min(count, (size_t)(dev->rp - dev->wp - 1));
-    PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
-    if (copy_from_user(dev->wp, buf, count)) {
+    /* space available, accept data, wrapping if needed */
+    count = min_t(size_t, count, spacefree(dev));
+    PDEBUG("Going to accept %li bytes at %u\n", (long)count, dev->wp);
+    count = scull_p_copy_in(dev, dev->wp, count, from);
+    if (!count) {
         mutex_unlock(&dev->lock);
         return -EFAULT;
     }
     dev->wp += count;
-    if (dev->wp == dev->end)
-        dev->wp = dev->buffer; /* wrapped */
     mutex_unlock(&dev->lock);
 
     /* wake up any readers */
@@ -217,13 +347,52 @@ static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t c
     return count;
 }
 
+/*
+** read & write
+** These are iov_iter based, which is what lets splice() and sendfile()
+** go through the generic helpers.
+*/
+static ssize_t scull_p_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct scull_pipe *dev = filp->private_data;
+    u64 start = local_clock();
+    ssize_t retval;
+
+    if (!iov_iter_count(to))
+        return 0;
+    if (scull_p_spsc)
+        retval = scull_p_read_spsc(dev, filp, to);
+    else
+        retval = scull_p_read_locked(dev, filp, to);
+    scull_stat_io(&dev->stats, 0, retval, start);
+    return retval;
+}
+
+static ssize_t scull_p_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *filp = iocb->ki_filp;
+    struct scull_pipe *dev = filp->private_data;
+    u64 start = local_clock();
+    ssize_t retval;
+
+    if (!iov_iter_count(from))
+        return 0;
+    if (scull_p_spsc)
+        retval = scull_p_write_spsc(dev, filp, from);
+    else
+        retval = scull_p_write_locked(dev, filp, from);
+    scull_stat_io(&dev->stats, 1, retval, start);
+    return retval;
+}
+
 static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 {
     struct scull_pipe *dev = filp->private_data;
     unsigned int mask = 0;
 
     /*
-     * Circular buffer; full if wp is right behind rp
+     * Circular buffer; full if wp is a whole buffer ahead of rp
      * empty if the two are equal
      */
     mutex_lock(&dev->lock);
@@ -243,6 +412,80 @@ static int scull_p_fasync(int fd, struct file *filp, int mode)
     return fasync_helper(fd, filp, mode, &dev->async_queue);
 }
 
+/*
+** Resize the ring of one pipe, keeping whatever is buffered. With no
+** buffer allocated yet the new size just applies to the next open.
+*/
+static int scull_p_resize(struct scull_pipe *dev, struct file *filp,
+                          unsigned long size)
+{
+    unsigned int used, off, first;
+    int others;
+    char *buffer;
+
+    if (size == 0 || size > SCULL_P_BUFFER_MAX)
+        return -EINVAL;
+    size = roundup_pow_of_two(size);
+
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+
+    /* lockless readers and writers can't be held off while we swap */
+    others = dev->nreaders + dev->nwriters;
+    others -= !!(filp->f_mode & FMODE_READ) + !!(filp->f_mode & FMODE_WRITE);
+    if (scull_p_spsc && others) {
+        mutex_unlock(&dev->lock);
+        return -EBUSY;
+    }
+
+    if (dev->buffer) {
+        used = dev->wp - dev->rp;
+        if (used > size) { /* would drop data */
+            mutex_unlock(&dev->lock);
+            return -EBUSY;
+        }
+        buffer = kvmalloc(size, GFP_KERNEL);
+        if (!buffer) {
+            scull_stat_inc(&dev->stats, alloc_failures);
+            mutex_unlock(&dev->lock);
+            return -ENOMEM;
+        }
+        /* unwrap the buffered data to the start of the new ring */
+        off = dev->rp & (dev->buffersize - 1);
+        first = min(used, dev->buffersize - off);
+        memcpy(buffer, dev->buffer + off, first);
+        memcpy(buffer + first, dev->buffer, used - first);
+        kvfree(dev->buffer);
+        dev->buffer = buffer;
+        dev->rp = 0;
+        dev->wp = used;
+    }
+    dev->buffersize = size;
+    mutex_unlock(&dev->lock);
+
+    /* there may be more room now */
+    wake_up_interruptible(&dev->outq);
+    return 0;
+}
+
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_pipe *dev = filp->private_data;
+
+    switch (cmd) {
+        case SCULL_P_IOCTSIZE: /* tell, arg is the new size */
+            if (!capable(CAP_SYS_ADMIN))
+                return -EPERM;
+            return scull_p_resize(dev, filp, arg);
+
+        case SCULL_P_IOCQSIZE: /* query, return it */
+            return READ_ONCE(dev->buffersize);
+    }
+
+    /* everything else is shared with the bare device */
+    return scull_ioctl(filp, cmd, arg);
+}
+
 /* FIXME use seq_file instead */
 #ifdef SCULL_DEBUG
 
@@ -259,8 +502,8 @@ static int scull_read_p_mem(struct seq_file *s, void *v)
             return -ERESTARTSYS;
 
         seq_printf(s, "\nDevice %i: %p\n", i, p);
-        seq_printf(s, "  Buffer: %p to %p (%i bytes)\n", p->buffer, p->end, p->buffersize);
-        seq_printf(s, "  rp: %p     wp %p\n", p->rp, p->wp);
+        seq_printf(s, "  Buffer: %p (%u bytes)\n", p->buffer, p->buffersize);
+        seq_printf(s, "  rp: %u     wp %u\n", p->rp, p->wp);
         seq_printf(s, "  readers: %i   writers %i\n", p->nreaders, p->nwriters);
 
         mutex_unlock(&p->lock);
@@ -287,10 +530,12 @@ static struct file_operations scullpipe_proc_ops = {
 struct file_operations scull_pipe_fops = {
     .owner = THIS_MODULE,
     .llseek = no_llseek,
-    .read = scull_p_read,
-    .write = scull_p_write,
+    .read_iter = scull_p_read_iter,
+    .write_iter = scull_p_write_iter,
+    .splice_read = compat_splice_read,
+    .splice_write = iter_file_splice_write,
     .poll = scull_p_poll,
-    .unlocked_ioctl = scull_ioctl,
+    .unlocked_ioctl = scull_p_ioctl,
     .open = scull_p_open,
     .release = scull_p_release,
     .fasync = scull_p_fasync,
@@ -309,6 +554,12 @@ static void scull_p_setup_cdev(struct scull_pipe *dev, int index) {
 int scull_p_init(dev_t firstdev)
 {
     int i, result;
+    char name[16];
+
+    /* the ring indices are masked, so the size must be a power of two */
+    if (scull_p_buffer <= 0)
+        scull_p_buffer = SCULL_P_BUFFER;
+    scull_p_buffer = roundup_pow_of_two(scull_p_buffer);
 
     result = register_chrdev_region(firstdev, scull_p_nr_devs, "scullp");
     if (result < 0) {
@@ -324,6 +575,19 @@ int scull_p_init(dev_t firstdev)
     memset(scull_p_devices, 0, scull_p_nr_devs * sizeof(struct scull_pipe));
 
     for (i = 0; i < scull_p_nr_devs; i++) {
+        snprintf(name, sizeof(name), "scullpipe%d", i);
+        if (scull_stats_init(&scull_p_devices[i].stats, name)) {
+            while (--i >= 0)
+                scull_stats_cleanup(&scull_p_devices[i].stats);
+            kfree(scull_p_devices);
+            scull_p_devices = NULL;
+            unregister_chrdev_region(firstdev, scull_p_nr_devs);
+            return 0;
+        }
+    }
+
+    for (i = 0; i < scull_p_nr_devs; i++) {
+        scull_p_devices[i].buffersize = scull_p_buffer;
         init_waitqueue_head(&(scull_p_devices[i].inq));
         init_waitqueue_head(&(scull_p_devices[i].outq));
         mutex_init(&scull_p_devices[i].lock);
@@ -350,7 +614,8 @@ void scull_p_cleanup(void)
 
     for (i = 0; i < scull_p_nr_devs; i++) {
         cdev_del(&scull_p_devices[i].cdev);
-        kfree(scull_p_devices[i].buffer);
+        kvfree(scull_p_devices[i].buffer);
+        scull_stats_cleanup(&scull_p_devices[i].stats);
     }
     kfree(scull_p_devices);
     unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
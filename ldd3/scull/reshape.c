@@ -0,0 +1,350 @@
+/*
+ * reshape.c -- changing the geometry of a bare device that has data
+ *
+ * scull_quantum and scull_qset only reach a device when it is trimmed.
+ * SCULL_IOCSGEOM gives a device a geometry of its own, which trimming
+ * keeps. On a device with data the data is copied into the new layout,
+ * built on the side while the old one goes on serving reads; the new
+ * one is swapped in under the write lock at the end. Anything that
+ * changes the contents (writes, trims, punches, copies, snapshots,
+ * faults, migration) waits for the swap, so nothing written in the
+ * meantime can be lost; mappings are torn down as the reshape starts,
+ * so stores through them fault and wait too. Both copies exist for a
+ * while, and the device is charged for both until the swap.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/sched/signal.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "scull.h"
+
+struct scull_reshape {
+    struct file *filp; /* keeps the device open */
+    int quantum, qset; /* the new geometry */
+    int geom_quantum, geom_qset; /* as asked for, 0 = the module's */
+    struct xarray qsets; /* the new layout */
+    long held; /* quanta in it */
+};
+
+static DECLARE_WAIT_QUEUE_HEAD(scull_reshape_wq);
+
+/*
+** Wait, without any lock, for a reshape of dev to finish; EAGAIN for a
+** non-blocking file. The copy holds dev->rwsem for reading throughout,
+** and a writer queued behind it would hold up every new reader too, so
+** nobody may queue for the write lock while a reshape runs.
+*/
+int scull_reshape_wait(struct scull_dev *dev, struct file *filp)
+{
+    if (!READ_ONCE(dev->reshape))
+        return 0;
+    if (filp && (filp->f_flags & O_NONBLOCK))
+        return -EAGAIN;
+    if (wait_event_killable(scull_reshape_wq, !READ_ONCE(dev->reshape)))
+        return -ERESTARTSYS;
+    return 0;
+}
+
+/*
+** Take dev->rwsem, shared or exclusive, to change what the device
+** holds. During a reshape that has to wait until the new layout is in,
+** or fails with EAGAIN for a non-blocking file.
+*/
+int scull_lock_for_change(struct scull_dev *dev, struct file *filp, int excl)
+{
+    int retval;
+
+    for (;;) {
+        retval = scull_reshape_wait(dev, filp);
+        if (retval)
+            return retval;
+        if (excl ? down_write_killable(&dev->rwsem)
+                 : down_read_killable(&dev->rwsem))
+            return -ERESTARTSYS;
+        if (!dev->reshape)
+            return 0;
+        /* one started in between */
+        if (excl)
+            up_write(&dev->rwsem);
+        else
+            up_read(&dev->rwsem);
+    }
+}
+
+/*
+** Return quantum s_pos of qset "item" in the new layout, allocating
+** what is missing. Nobody else sees the new layout yet, so there is
+** nothing to lock or publish; but every qset in it gets its index
+** reserved in the live xarray, so that the swap needs no memory.
+*/
+static void *scull_reshape_quantum(struct scull_dev *dev,
+                                   struct scull_reshape *rs,
+                                   unsigned long item, int s_pos)
+{
+    struct scull_qset *dptr = xa_load(&rs->qsets, item);
+    void *q;
+
+    if (!dptr) {
+        dptr = scull_alloc_qset();
+        if (!dptr)
+            goto nomem;
+        if (xa_reserve(dev->qsets, item, GFP_KERNEL)) {
+            scull_free_qset(dptr);
+            goto nomem;
+        }
+        if (xa_err(xa_store(&rs->qsets, item, dptr, GFP_KERNEL))) {
+            xa_release(dev->qsets, item);
+            scull_free_qset(dptr);
+            goto nomem;
+        }
+    }
+    if (!dptr->data) {
+        dptr->data = scull_alloc_array(rs->qset);
+        if (!dptr->data)
+            goto nomem;
+    }
+    q = dptr->data[s_pos];
+    if (!q) {
+        if (scull_charge(dev, rs->quantum))
+            return ERR_PTR(-ENOSPC);
+        q = scull_alloc_quantum_node(rs->quantum, scull_dev_node(dev));
+        if (!q) {
+            scull_uncharge(dev, rs->quantum);
+            goto nomem;
+        }
+        dptr->data[s_pos] = q;
+        rs->held++;
+    }
+    return q;
+
+    nomem:
+        scull_stat_inc(&dev->stats, alloc_failures);
+        return ERR_PTR(-ENOMEM);
+}
+
+/*
+** Copy the data of dev into the new layout. Called with the device
+** locked for reading, so the old layout only changes form: quanta may
+** be packed or unpacked under us, but not written. Holes and zero
+** quanta are simply not copied, nor is anything past the end.
+*/
+static int scull_reshape_copy(struct scull_dev *dev, struct scull_reshape *rs)
+{
+    u64 itemsize = scull_itemsize(dev);
+    unsigned long index, size = dev->size;
+    struct scull_qset *dptr;
+    loff_t start, pos, end;
+    int i, s_pos, q_pos, idx;
+    unsigned long item;
+    void *src, *dst;
+    size_t chunk;
+    int retval = 0;
+
+    xa_for_each(dev->qsets, index, dptr) {
+        idx = srcu_read_lock(&scull_srcu);
+        for (i = 0; dptr->data && i < dev->qset; i++) {
+            start = index * itemsize + (u64)i * dev->quantum;
+            if (start >= size)
+                break;
+            src = scull_qset_quantum(dev, dptr, i);
+            if (IS_ERR(src)) {
+                retval = PTR_ERR(src);
+                break;
+            }
+            if (!src)
+                continue;
+            end = min_t(u64, start + dev->quantum, size);
+            for (pos = start; pos < end; pos += chunk) {
+                item = scull_split_geom(pos, rs->quantum, rs->qset,
+                                        &s_pos, &q_pos);
+                chunk = min_t(u64, rs->quantum - q_pos, end - pos);
+                dst = scull_reshape_quantum(dev, rs, item, s_pos);
+                if (IS_ERR(dst)) {
+                    retval = PTR_ERR(dst);
+                    break;
+                }
+                memcpy(dst + q_pos, src + (pos - start), chunk);
+            }
+            if (retval)
+                break;
+        }
+        srcu_read_unlock(&scull_srcu, idx);
+        if (!retval && fatal_signal_pending(current))
+            retval = -EINTR; /* only a SCULL_GEOM_WAIT caller has signals */
+        if (retval)
+            return retval;
+        cond_resched();
+    }
+    return 0;
+}
+
+/* the copy failed: drop the new layout. Called with the write lock held */
+static void scull_reshape_abort(struct scull_dev *dev, struct scull_reshape *rs)
+{
+    struct scull_trim_work *tw = NULL;
+    struct scull_qset *dptr;
+    unsigned long index;
+
+    xa_for_each(&rs->qsets, index, dptr) {
+        xa_release(dev->qsets, index);
+        scull_trim_add(dev, &tw, dptr, rs->quantum, rs->qset);
+    }
+    scull_trim_flush(tw);
+    xa_destroy(&rs->qsets);
+    scull_uncharge(dev, rs->held * rs->quantum);
+}
+
+/* put the new layout in place of the old one, with the write lock held */
+static void scull_reshape_swap(struct scull_dev *dev, struct scull_reshape *rs)
+{
+    struct scull_trim_work *tw = NULL;
+    struct scull_qset *dptr;
+    unsigned long index;
+
+    xa_for_each(dev->qsets, index, dptr) {
+        if (!xa_load(&rs->qsets, index))
+            xa_erase(dev->qsets, index);
+        scull_trim_add(dev, &tw, dptr, dev->quantum, dev->qset);
+    }
+    scull_trim_flush(tw);
+    /* each index is either in use or reserved, so this can't fail */
+    xa_for_each(&rs->qsets, index, dptr)
+        xa_store(dev->qsets, index, dptr, GFP_KERNEL);
+    xa_destroy(&rs->qsets);
+
+    atomic_long_set(&dev->stats.packed_raw, 0);
+    atomic_long_set(&dev->stats.packed_bytes, 0);
+    atomic_long_set(&dev->stats.charged, rs->held * rs->quantum);
+
+    dev->quantum = rs->quantum;
+    dev->qset = rs->qset;
+    dev->geom_quantum = rs->geom_quantum;
+    dev->geom_qset = rs->geom_qset;
+    dev->gen++; /* cursors hold offsets in the old geometry */
+}
+
+static int scull_reshape_run(struct scull_dev *dev)
+{
+    struct scull_reshape *rs = dev->reshape;
+    int retval;
+
+    down_read(&dev->rwsem);
+    retval = scull_reshape_copy(dev, rs);
+    up_read(&dev->rwsem);
+
+    down_write(&dev->rwsem);
+    if (retval)
+        scull_reshape_abort(dev, rs);
+    else
+        scull_reshape_swap(dev, rs);
+    dev->reshape_error = retval;
+    dev->reshape = NULL;
+    up_write(&dev->rwsem);
+    wake_up_all(&scull_reshape_wq);
+
+    fput(rs->filp);
+    kfree(rs);
+    return retval;
+}
+
+static void scull_reshape_worker(struct work_struct *work)
+{
+    scull_reshape_run(container_of(work, struct scull_dev, reshape_work));
+}
+
+/*
+** SCULL_IOCSGEOM. An empty device just takes the new geometry; anything
+** else is reshaped, in the background unless the caller asked to wait.
+** Only one reshape runs on a device at a time.
+*/
+int scull_reshape_start(struct file *filp, struct scull_dev *dev,
+                        struct scull_geometry *geom)
+{
+    int quantum = geom->quantum ? geom->quantum : scull_quantum;
+    int qset = geom->qset ? geom->qset : scull_qset;
+    struct scull_reshape *rs;
+    int retval = 0;
+
+    if (geom->quantum < 0 || geom->qset < 0 || geom->flags & ~SCULL_GEOM_WAIT)
+        return -EINVAL;
+    if (!scull_quantum_ok(quantum) || !scull_qset_ok(qset))
+        return -EINVAL;
+
+    /* don't queue behind a running copy, see scull_reshape_wait */
+    if (READ_ONCE(dev->reshape))
+        return -EBUSY;
+    rs = kmalloc(sizeof(*rs), GFP_KERNEL);
+    if (!rs)
+        return -ENOMEM;
+    if (down_write_killable(&dev->rwsem)) {
+        kfree(rs);
+        return -ERESTARTSYS;
+    }
+    if (dev->reshape) {
+        retval = -EBUSY;
+        goto out;
+    }
+    if (xa_empty(dev->qsets) || (quantum == dev->quantum && qset == dev->qset)) {
+        /* nothing to move */
+        dev->quantum = quantum;
+        dev->qset = qset;
+        dev->geom_quantum = geom->quantum;
+        dev->geom_qset = geom->qset;
+        dev->gen++;
+        goto out;
+    }
+
+    rs->filp = get_file(filp);
+    rs->quantum = quantum;
+    rs->qset = qset;
+    rs->geom_quantum = geom->quantum;
+    rs->geom_qset = geom->qset;
+    xa_init(&rs->qsets);
+    rs->held = 0;
+    dev->reshape = rs;
+    /*
+    ** Stores through a mapping don't go through scull_lock_for_change;
+    ** zap the mappings now, before the copy, so that they have to fault
+    ** (and wait for the swap) instead of writing to the old pages.
+    */
+    unmap_mapping_range(filp->f_mapping, 0, 0, 1);
+    up_write(&dev->rwsem);
+
+    if (geom->flags & SCULL_GEOM_WAIT)
+        return scull_reshape_run(dev);
+    queue_work(system_unbound_wq, &dev->reshape_work);
+    return 0;
+
+    out:
+        up_write(&dev->rwsem);
+        kfree(rs);
+        return retval;
+}
+
+/* SCULL_IOCGGEOM: the geometry in use, which changes when a reshape ends */
+void scull_reshape_get(struct scull_dev *dev, struct scull_geometry *geom)
+{
+    down_read(&dev->rwsem);
+    geom->quantum = dev->quantum;
+    geom->qset = dev->qset;
+    geom->flags = dev->reshape ? SCULL_GEOM_BUSY : 0;
+    geom->error = dev->reshape_error;
+    up_read(&dev->rwsem);
+}
+
+void scull_reshape_dev_init(struct scull_dev *dev)
+{
+    INIT_WORK(&dev->reshape_work, scull_reshape_worker);
+}
+
+void scull_reshape_dev_cleanup(struct scull_dev *dev)
+{
+    flush_work(&dev->reshape_work);
+}
@@ -19,9 +19,27 @@
 #define _SCULL_H_
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
+
+#ifdef __KERNEL__
 #include <linux/kernel.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
 #include <linux/cdev.h>
+#include <linux/xarray.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/sched/clock.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/refcount.h>
+#include <linux/srcu.h>
+#include <linux/jiffies.h>
+#include <linux/math64.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#endif
 
 /*
 ** Debugging macros
@@ -55,11 +73,14 @@
 
 /*
 ** Bare device is a variable-length region of memory
-** Uses a linked list of indirect blocks
+** Uses an xarray of indirect blocks, indexed by qset number
 **
-** "scull_dev->data" points to an array of pointers
+** each "scull_dev->qsets" entry points to an array of pointers
 ** each pointer refers to a memory area of SCULL_QUANTUM bytes
 ** the array (quantum->set) is SCULL_QSET long
+**
+** quanta that are a multiple of PAGE_SIZE are allocated as pages,
+** which lets the device be mmap()ed
 */
 #ifndef SCULL_QUANTUM
 #define SCULL_QUANTUM 4000
@@ -71,27 +92,331 @@
 
 /*
 ** Pipe device - a simple circular buffer
+** its size is rounded up to a power of two
  */
 #ifndef SCULL_P_BUFFER
-#define SCULL_P_BUFFER 4000
+#define SCULL_P_BUFFER 4096
+#endif
+
+/*
+** Snapshot devices, filled by SCULL_IOCSNAP
+*/
+#ifndef SCULL_SNAP_NR_DEVS
+#define SCULL_SNAP_NR_DEVS 4
+#endif
+
+#ifndef SCULL_P_BUFFER_MAX
+#define SCULL_P_BUFFER_MAX (16 << 20) /* largest SCULL_P_IOCTSIZE */
 #endif
 
+#ifdef __KERNEL__ /* the rest is of no use to user space benchmarks */
+
+struct seq_file;
+struct scull_numa;
+struct scull_geometry;
+struct scull_reshape;
+struct scull_trim_work;
+
+/*
+** Statistics, always on. The counters are per-CPU so the hot paths
+** only do a few unshared adds; they are summed when read via debugfs.
+*/
+#define SCULL_LAT_BUCKETS 32 /* log2 buckets, the last one is open */
+
+struct scull_stats_cpu {
+    u64 reads, writes; /* completed calls */
+    u64 bytes_read, bytes_written;
+    u64 lock_wait_ns; /* time spent acquiring the device lock */
+    u64 sleeps; /* times a reader or writer blocked */
+    u64 alloc_failures;
+    u64 pool_hits, pool_misses; /* quanta taken from / missed in the reserve */
+    u64 dedup_zero, dedup_hits; /* quanta written as zero / as a duplicate */
+    u64 dedup_saved; /* bytes those writes didn't allocate */
+    u64 seq_writes; /* writes starting where the last one ended */
+    u64 folios; /* large pages taken to carve quanta from */
+    u64 folio_fallbacks; /* times a PMD-sized one couldn't be had */
+    u64 read_lat[SCULL_LAT_BUCKETS];
+    u64 write_lat[SCULL_LAT_BUCKETS];
+    u64 write_size[SCULL_LAT_BUCKETS]; /* log2(bytes) written, rounded up */
+};
+
+struct scull_stats {
+    struct scull_stats_cpu __percpu *cpu;
+    atomic_long_t packed_raw; /* bytes of data held compressed */
+    atomic_long_t packed_bytes; /* ... and what they take compressed */
+    atomic_long_t charged; /* bytes of quanta in the slots, see budget.c */
+    atomic_long_t filled; /* bytes written into new space, see adapt.c */
+    struct dentry *dentry;
+    /* more for the stats file, where the device type has more to say */
+    void (*show)(struct seq_file *s, struct scull_stats *st);
+};
+
+#define scull_stat_inc(st, field)    this_cpu_inc((st)->cpu->field)
+#define scull_stat_add(st, field, n) this_cpu_add((st)->cpu->field, n)
+
+/* account the time since "start" as lock wait */
+static inline void scull_stat_lock_wait(struct scull_stats *st, u64 start)
+{
+    scull_stat_add(st, lock_wait_ns, local_clock() - start);
+}
+
+/*
+** account one read or write that started at "start" and returned ret;
+** hands back the elapsed time for the tracepoints
+*/
+static inline u64 scull_stat_io(struct scull_stats *st, int write,
+                                ssize_t ret, u64 start)
+{
+    u64 ns = local_clock() - start;
+    int bucket = min_t(int, ilog2(ns | 1), SCULL_LAT_BUCKETS - 1);
+
+    if (write) {
+        scull_stat_inc(st, writes);
+        if (ret > 0) {
+            scull_stat_add(st, bytes_written, ret);
+            scull_stat_inc(st, write_size[min_t(int, order_base_2(ret),
+                                                SCULL_LAT_BUCKETS - 1)]);
+        }
+        scull_stat_inc(st, write_lat[bucket]);
+    } else {
+        scull_stat_inc(st, reads);
+        if (ret > 0)
+            scull_stat_add(st, bytes_read, ret);
+        scull_stat_inc(st, read_lat[bucket]);
+    }
+    return ns;
+}
+
+/*
+** A slot of a qset's data array normally points straight at its quantum.
+** Once the quantum is shared (SCULL_IOCCOPY) the slot holds a pointer to
+** a refcounted scull_shared instead, tagged with SCULL_Q_SHARED, and
+** writers copy the quantum before they modify it. Shared quanta are
+** freed after an SRCU grace period, so lockless readers that picked up
+** the slot before a writer replaced it can finish their copy; readers
+** hold scull_srcu for that. A quantum known to be all zeroes is just
+** the SCULL_Q_ZERO marker, and reads like a hole (see dedup.c).
+*/
+#define SCULL_Q_SHARED 1UL
+#define SCULL_Q_PACKED 2UL /* compressed, see compress.c */
+#define SCULL_Q_TAGS   3UL
+#define SCULL_Q_ZERO   ((void *)SCULL_Q_TAGS)
+
+struct scull_shared {
+    refcount_t ref; /* one per slot pointing here */
+    int quantum; /* size of the data */
+    void *data;
+    struct hlist_node hnode; /* in the dedup table, if hashed */
+    u64 hash;
+    struct rcu_head rcu;
+};
+
+/* a compressed quantum; never shared */
+struct scull_packed {
+    unsigned int len;
+    u8 data[];
+};
+
+extern struct srcu_struct scull_srcu;
+
+static inline int scull_q_is_shared(void *q)
+{
+    return ((unsigned long)q & SCULL_Q_TAGS) == SCULL_Q_SHARED;
+}
+
+static inline struct scull_shared *scull_q_shared(void *q)
+{
+    return (struct scull_shared *)((unsigned long)q & ~SCULL_Q_SHARED);
+}
+
+static inline int scull_q_is_packed(void *q)
+{
+    return ((unsigned long)q & SCULL_Q_TAGS) == SCULL_Q_PACKED;
+}
+
+static inline int scull_q_is_zero(void *q)
+{
+    return q == SCULL_Q_ZERO;
+}
+
+/* does the slot hold a quantum, which the device is charged for? */
+static inline int scull_q_holds(void *q)
+{
+    return q && !scull_q_is_zero(q);
+}
+
+static inline struct scull_packed *scull_q_packed(void *q)
+{
+    return (struct scull_packed *)((unsigned long)q & ~SCULL_Q_PACKED);
+}
+
+/*
+** The bytes behind a slot, shared or not; packed ones need unpacking,
+** and zero ones have none.
+*/
+static inline void *scull_q_data(void *q)
+{
+    if (scull_q_is_zero(q))
+        return NULL;
+    return scull_q_is_shared(q) ? scull_q_shared(q)->data : q;
+}
+
 /* Scull quantum sets */
 struct scull_qset {
     void **data;
-    struct scull_qset *next;
+    struct mutex lock; /* serialises writers to this qset */
+    struct list_head list; /* on a deferred trim batch */
+    unsigned long touched; /* jiffies of the last access, for compression */
+};
+
+/*
+** A per-device reserve of preallocated quanta, topped up from a work
+** item, so bursts of writes mostly skip the allocator (see alloc.c).
+*/
+struct scull_pool {
+    spinlock_t lock;
+    void *head; /* free quanta, chained through their first word */
+    int nr; /* quanta on the list */
+    int quantum; /* their size */
+    int want; /* the size the device asked for last */
+    int target; /* how many to keep, 0 if the pool is off */
+    struct work_struct refill;
+};
+
+/*
+** Where a device cuts its quanta from in scull_folio mode (alloc.c): a
+** large compound page, and how much of it is gone.
+*/
+struct scull_carve {
+    spinlock_t lock;
+    struct page *page; /* NULL until the first one */
+    unsigned int off;
+};
+
+/*
+** Quanta that are a whole number of pages come straight from the page
+** allocator, so that they can be mapped into user space. Anything else
+** is slab memory.
+*/
+static inline int scull_quantum_paged(int quantum)
+{
+    return quantum >= PAGE_SIZE && !(quantum & ~PAGE_MASK);
+}
+
+/*
+** What the adaptive geometry (adapt.c) has seen and chosen: the write
+** counters as they were at the last choice, so that each choice only
+** looks at the writes since.
+*/
+struct scull_adapt {
+    u64 writes, seq_writes;
+    u64 write_size[SCULL_LAT_BUCKETS];
+    int typical; /* the write size of the last choice */
+    int seq_pct; /* how many of those writes were sequential, in % */
+    unsigned long changes; /* how often the quantum changed */
 };
 
 struct scull_dev {
-    struct scull_qset *data; /* Pointer to first quantum set */
+    struct xarray *qsets; /* quantum sets, indexed by qset number */
     int quantum; /* the current quantum size */
     int qset; /* the current array size */
     unsigned long size; /* amount of data stored */
+    unsigned long gen; /* bumped whenever qsets go away, see scull_cursor */
+    unsigned long budget; /* bytes of quanta allowed, 0 = no limit */
+    int numa_policy; /* SCULL_NUMA_*, see numa.c */
+    int numa_node; /* for SCULL_NUMA_BIND */
+    int numa_next; /* last node used by SCULL_NUMA_INTERLEAVE */
+    int geom_quantum, geom_qset; /* set by SCULL_IOCSGEOM, 0 = the module's */
+    struct scull_reshape *reshape; /* in progress, see reshape.c */
+    struct work_struct reshape_work;
+    int reshape_error; /* how the last one ended */
+    int adaptive; /* pick the quantum from the writes seen, see adapt.c */
+    struct scull_adapt adapt;
+    unsigned long last_end; /* where the last write ended */
     unsigned int access_key; /* used by sculluid and scullpriv */
-    struct mutex lock; /* mutual exclusion */
+    struct rw_semaphore rwsem; /* shared for I/O, exclusive to trim */
+    struct scull_stats stats;
+    struct scull_pool pool;
+    struct scull_carve carve;
+    struct delayed_work compress; /* packs cold qsets, see compress.c */
     struct cdev cdev; /* char device structure */
 };
 
+/*
+** Where the last read or write through an open file stopped, so that
+** the next one can carry on from there without dividing the offset or
+** looking the qset up again. It is only good for the device generation
+** it was made in: trimming, punching or reshaping a device can free
+** qsets or change the geometry, and those bump dev->gen, under the
+** write lock.
+*/
+struct scull_cursor {
+    unsigned long gen;
+    loff_t pos; /* the next byte, -1 if there is none yet */
+    struct scull_qset *dptr; /* qset "item", NULL if not looked up yet */
+    unsigned long item;
+    int s_pos, q_pos;
+};
+
+/* what filp->private_data points to for bare and snapshot devices */
+struct scull_file {
+    struct scull_dev *dev;
+    spinlock_t lock; /* for the cursor; one file can do parallel I/O */
+    struct scull_cursor cur;
+};
+
+/*
+** Offsets are 64-bit all the way: a qset of large quanta can hold more
+** than 4GB by itself, so a device offset is split with 64-bit divisions
+** into the qset it falls in, the slot there and the offset in that
+** quantum. The size is an unsigned long, as large as memory can be;
+** nothing can be written beyond SCULL_SIZE_MAX.
+*/
+#define SCULL_SIZE_MAX ((loff_t)min_t(u64, ULONG_MAX, MAX_LFS_FILESIZE))
+
+static inline u64 scull_itemsize(struct scull_dev *dev)
+{
+    return (u64)dev->quantum * dev->qset;
+}
+
+static inline unsigned long scull_split_geom(loff_t pos, int quantum, int qset,
+                                             int *s_pos, int *q_pos)
+{
+    unsigned long item;
+    u64 rest;
+    u32 q;
+
+    item = div64_u64_rem(pos, (u64)quantum * qset, &rest);
+    *s_pos = div_u64_rem(rest, quantum, &q);
+    *q_pos = q;
+    return item;
+}
+
+static inline unsigned long scull_split(struct scull_dev *dev, loff_t pos,
+                                        int *s_pos, int *q_pos)
+{
+    return scull_split_geom(pos, dev->quantum, dev->qset, s_pos, q_pos);
+}
+
+/*
+** A quantum and a pointer array each have to fit in one allocation.
+** Their product, the bytes in a qset, is only ever used as 64 bits.
+*/
+static inline int scull_quantum_ok(unsigned long quantum)
+{
+    return quantum && quantum <= KMALLOC_MAX_SIZE;
+}
+
+static inline int scull_qset_ok(unsigned long qset)
+{
+    return qset && qset <= KMALLOC_MAX_SIZE / sizeof(void *);
+}
+
+static inline struct scull_dev *scull_file_dev(struct file *filp)
+{
+    return ((struct scull_file *)filp->private_data)->dev;
+}
+
 /*
  * Configurable parameters
  */
@@ -100,9 +425,26 @@ extern int scull_major;
 extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
+extern int scull_legacy_rw;
+extern int scull_pool_quanta;
+extern int scull_compress_secs;
+extern int scull_dedup;
+extern int scull_adaptive;
+extern unsigned long scull_dev_budget;
+extern atomic_long_t scull_mem_used;
+extern atomic_long_t scull_node_used[];
+extern atomic_long_t scull_trim_backlog;
+extern struct scull_dev *scull_devices;
 
 extern int scull_p_buffer;
 
+/* note an access to a qset, so that only cold ones get compressed */
+static inline void scull_qset_touch(struct scull_qset *dptr)
+{
+    if (scull_compress_secs && READ_ONCE(dptr->touched) != jiffies)
+        WRITE_ONCE(dptr->touched, jiffies);
+}
+
 /*
  * Prototypes for shared functions
  */
@@ -111,16 +453,86 @@ int  scull_p_init(dev_t dev);
 void scull_p_cleanup(void);
 int  scull_access_init(dev_t dev);
 void scull_access_cleanup(void);
-
+int  scull_snap_init(dev_t dev);
+void scull_snap_cleanup(void);
+long scull_snap_take(struct file *filp, struct scull_dev *dev);
+int  scull_stats_init(struct scull_stats *st, const char *name);
+void scull_stats_cleanup(struct scull_stats *st);
+void scull_stats_root_init(void);
+void scull_stats_root_cleanup(void);
+int  scull_alloc_init(void);
+void scull_alloc_cleanup(void);
+struct scull_qset *scull_alloc_qset(void);
+void scull_free_qset(struct scull_qset *qs);
+void **scull_alloc_array(int qset);
+void scull_free_array(int qset, void **data);
+void *scull_alloc_quantum(int quantum);
+void *scull_alloc_quantum_node(int quantum, int node);
+void scull_free_quantum(int quantum, void *data);
+void scull_put_quantum(int quantum, void *q);
+void *scull_share_quantum(int quantum, void **slot);
+void *scull_unshare_quantum(int quantum, void **slot);
+void scull_pool_init(struct scull_pool *pool, int quantum, int target);
+void scull_pool_cleanup(struct scull_pool *pool);
+void *scull_pool_get(struct scull_pool *pool, int quantum);
+unsigned long scull_pool_shrink(struct scull_pool *pool, unsigned long nr);
+void scull_carve_init(struct scull_carve *carve);
+void scull_carve_cleanup(struct scull_carve *carve);
+void *scull_carve_quantum(struct scull_dev *dev, int quantum);
+void scull_compress_init(void);
+void scull_compress_cleanup(void);
+void scull_compress_dev_init(struct scull_dev *dev);
+void scull_compress_dev_cleanup(struct scull_dev *dev);
+void scull_compress_kick(struct scull_dev *dev);
+void *scull_unpack_locked(struct scull_dev *dev, void **slot);
+void *scull_unpack(struct scull_dev *dev, struct scull_qset *dptr, int s_pos);
+void scull_packed_forget(struct scull_dev *dev, void *q);
+ssize_t scull_dedup_write(struct scull_dev *dev, struct scull_qset *dptr,
+                          int s_pos, struct iov_iter *from);
+int  scull_dedup_claim(struct scull_shared *sh);
+void scull_dedup_forget(struct scull_shared *sh);
+void scull_budget_init(void);
+void scull_budget_cleanup(void);
+int  scull_charge(struct scull_dev *dev, long bytes);
+void scull_uncharge(struct scull_dev *dev, long bytes);
+int  scull_dev_node(struct scull_dev *dev);
+int  scull_numa_set(struct scull_dev *dev, struct scull_numa *numa);
+void scull_numa_get(struct scull_dev *dev, struct scull_numa *numa);
+long scull_migrate(struct file *filp, struct scull_dev *dev, int node);
+void scull_numa_show(struct seq_file *s, struct scull_stats *st);
+int  scull_reshape_start(struct file *filp, struct scull_dev *dev,
+                         struct scull_geometry *geom);
+void scull_reshape_get(struct scull_dev *dev, struct scull_geometry *geom);
+int  scull_reshape_wait(struct scull_dev *dev, struct file *filp);
+int  scull_lock_for_change(struct scull_dev *dev, struct file *filp, int excl);
+void scull_reshape_dev_init(struct scull_dev *dev);
+void scull_reshape_dev_cleanup(struct scull_dev *dev);
+int  scull_adapt_quantum(struct scull_dev *dev);
+void scull_adapt_show(struct seq_file *s, struct scull_stats *st);
 
 int scull_trim(struct scull_dev *dev);
+struct xarray *scull_qsets_alloc(void);
+void scull_qsets_free(struct scull_dev *dev);
+void scull_trim_add(struct scull_dev *dev, struct scull_trim_work **tw,
+                    struct scull_qset *dptr, int quantum, int qset);
+void scull_trim_flush(struct scull_trim_work *tw);
+int scull_file_open(struct file *filp, struct scull_dev *dev);
+int scull_release(struct inode *inode, struct file *filp);
+struct scull_qset *scull_follow(struct scull_dev *dev, unsigned long n);
+void **scull_get_slot(struct scull_dev *dev, struct scull_qset *dptr, int s_pos);
+void *scull_qset_quantum(struct scull_dev *dev, struct scull_qset *dptr,
+                         int s_pos);
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
                    loff_t *f_pos);
 ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
                    loff_t *f_pos);
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
 long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 loff_t scull_llseek(struct file *filp, loff_t off, int whence);
 
+#endif /* __KERNEL__ */
+
 /*
  * Ioctl definitions
  */
@@ -153,6 +565,68 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence);
 #define SCULL_P_IOCTSIZE  _IO(SCULL_IOC_MAGIC,  13)
 #define SCULL_P_IOCQSIZE  _IO(SCULL_IOC_MAGIC,  14)
 
-#define SCULL_IOC_MAXNR 14
+/* a byte range of a bare device */
+struct scull_range {
+    __u64 offset;
+    __u64 length;
+};
+
+/* free the quanta in a range, which then reads as zeroes */
+#define SCULL_IOCPUNCH    _IOW(SCULL_IOC_MAGIC, 15, struct scull_range)
+
+/* copy a range of another bare device (src_fd) into this one */
+struct scull_copy_range {
+    __s64 src_fd;
+    __u64 src_offset;
+    __u64 length;
+    __u64 dst_offset;
+};
+
+/* shares whole quanta where it can; returns the bytes copied */
+#define SCULL_IOCCOPY     _IOW(SCULL_IOC_MAGIC, 16, struct scull_copy_range)
+
+/* snapshot a bare device, returns N for /dev/scullsnapN */
+#define SCULL_IOCSNAP     _IO(SCULL_IOC_MAGIC,  17)
+/* on a snapshot: let it go once the last file on it is closed */
+#define SCULL_IOCSNAPDROP _IO(SCULL_IOC_MAGIC,  18)
+
+/* a bare device's budget in bytes, 0 for none; setting it needs CAP_SYS_ADMIN */
+#define SCULL_IOCSBUDGET  _IOW(SCULL_IOC_MAGIC, 19, __u64)
+#define SCULL_IOCGBUDGET  _IOR(SCULL_IOC_MAGIC, 20, __u64)
+
+/* placement of a bare device's new quanta */
+#define SCULL_NUMA_LOCAL      0 /* on the writer's node, the default */
+#define SCULL_NUMA_INTERLEAVE 1 /* round robin over the nodes with memory */
+#define SCULL_NUMA_BIND       2 /* all on "node" */
+
+struct scull_numa {
+    __s32 policy;
+    __s32 node; /* only for SCULL_NUMA_BIND, -1 otherwise */
+};
+
+#define SCULL_IOCSNUMA    _IOW(SCULL_IOC_MAGIC, 21, struct scull_numa)
+#define SCULL_IOCGNUMA    _IOR(SCULL_IOC_MAGIC, 22, struct scull_numa)
+/* move the quanta to node "arg", returns how many were moved */
+#define SCULL_IOCMIGRATE  _IO(SCULL_IOC_MAGIC,  23)
+
+/*
+** A bare device's own geometry, 0 for the module's. Setting it on a
+** device with data reshapes the data in the background, or before
+** returning with SCULL_GEOM_WAIT; SCULL_GEOM_BUSY says one is running.
+*/
+#define SCULL_GEOM_WAIT 1
+#define SCULL_GEOM_BUSY 2
+
+struct scull_geometry {
+    __s32 quantum;
+    __s32 qset;
+    __u32 flags;
+    __s32 error; /* on get: how the last reshape ended, 0 or -errno */
+};
+
+#define SCULL_IOCSGEOM    _IOW(SCULL_IOC_MAGIC, 24, struct scull_geometry)
+#define SCULL_IOCGGEOM    _IOR(SCULL_IOC_MAGIC, 25, struct scull_geometry)
+
+#define SCULL_IOC_MAXNR 25
 
 #endif // _SCULL_H_
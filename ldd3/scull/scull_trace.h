@@ -0,0 +1,178 @@
+/*
+ * scull_trace.h -- static tracepoints for the scull hot paths
+ *
+ * All events live under events/scull/ in tracefs and can be used from
+ * ftrace, perf or bpftrace without rebuilding the module.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* what scull_alloc allocated */
+#define SCULL_ALLOC_QSET    0 /* a struct scull_qset */
+#define SCULL_ALLOC_ARRAY   1 /* the quantum pointer array of a qset */
+#define SCULL_ALLOC_QUANTUM 2
+
+DECLARE_EVENT_CLASS(scull_io,
+    TP_PROTO(unsigned int minor, loff_t offset, size_t count, ssize_t ret,
+             u64 ns),
+    TP_ARGS(minor, offset, count, ret, ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, offset)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+        __field(u64, ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->offset = offset;
+        __entry->count = count;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+
+    TP_printk("minor=%u offset=%lld count=%zu ret=%zd ns=%llu",
+              __entry->minor, __entry->offset, __entry->count,
+              __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(scull_io, scull_read,
+    TP_PROTO(unsigned int minor, loff_t offset, size_t count, ssize_t ret,
+             u64 ns),
+    TP_ARGS(minor, offset, count, ret, ns)
+);
+
+DEFINE_EVENT(scull_io, scull_write,
+    TP_PROTO(unsigned int minor, loff_t offset, size_t count, ssize_t ret,
+             u64 ns),
+    TP_ARGS(minor, offset, count, ret, ns)
+);
+
+TRACE_EVENT(scull_follow,
+    TP_PROTO(unsigned int minor, unsigned long item, int allocated),
+    TP_ARGS(minor, item, allocated),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(unsigned long, item)
+        __field(int, allocated)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->item = item;
+        __entry->allocated = allocated;
+    ),
+
+    TP_printk("minor=%u item=%lu allocated=%d",
+              __entry->minor, __entry->item, __entry->allocated)
+);
+
+/* one batch of a deferred trim has been freed */
+TRACE_EVENT(scull_trim,
+    TP_PROTO(unsigned int minor, int qsets, u64 ns),
+    TP_ARGS(minor, qsets, ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, qsets)
+        __field(u64, ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->qsets = qsets;
+        __entry->ns = ns;
+    ),
+
+    TP_printk("minor=%u qsets=%d ns=%llu",
+              __entry->minor, __entry->qsets, __entry->ns)
+);
+
+TRACE_EVENT(scull_alloc,
+    TP_PROTO(unsigned int minor, int what, size_t size, int ok),
+    TP_ARGS(minor, what, size, ok),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, what)
+        __field(size_t, size)
+        __field(int, ok)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->what = what;
+        __entry->size = size;
+        __entry->ok = ok;
+    ),
+
+    TP_printk("minor=%u what=%s size=%zu ok=%d", __entry->minor,
+              __print_symbolic(__entry->what,
+                               { SCULL_ALLOC_QSET, "qset" },
+                               { SCULL_ALLOC_ARRAY, "array" },
+                               { SCULL_ALLOC_QUANTUM, "quantum" }),
+              __entry->size, __entry->ok)
+);
+
+/* a pipe reader (write=0) or writer (write=1) is about to block */
+TRACE_EVENT(scull_p_sleep,
+    TP_PROTO(unsigned int minor, int write, size_t count),
+    TP_ARGS(minor, write, count),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, write)
+        __field(size_t, count)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->write = write;
+        __entry->count = count;
+    ),
+
+    TP_printk("minor=%u %s count=%zu", __entry->minor,
+              __entry->write ? "writer" : "reader", __entry->count)
+);
+
+/* ... and has woken up again after ns nanoseconds */
+TRACE_EVENT(scull_p_wake,
+    TP_PROTO(unsigned int minor, int write, size_t count, u64 ns),
+    TP_ARGS(minor, write, count, ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, write)
+        __field(size_t, count)
+        __field(u64, ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->write = write;
+        __entry->count = count;
+        __entry->ns = ns;
+    ),
+
+    TP_printk("minor=%u %s count=%zu ns=%llu", __entry->minor,
+              __entry->write ? "writer" : "reader", __entry->count,
+              __entry->ns)
+);
+
+#endif /* _SCULL_TRACE_H */
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>
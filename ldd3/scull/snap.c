@@ -0,0 +1,328 @@
+/*
+ * snap.c -- read-only snapshots of the bare scull devices
+ *
+ * SCULL_IOCSNAP on a bare device fills a free scullsnap device with
+ * references to all of its quanta and returns the snapshot's number.
+ * The quanta are shared copy-on-write (see struct scull_shared), so
+ * taking a snapshot only walks the metadata, and from then on memory
+ * only grows by the quanta the live device overwrites. SCULL_IOCSNAPDROP
+ * on the snapshot lets it go again, once the last file on it is closed.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/errno.h>
+#include <linux/cdev.h>
+#include <linux/mm.h>
+#include <linux/bitops.h>
+#include <linux/bitmap.h>
+#include <linux/capability.h>
+#include <linux/spinlock.h>
+
+#include "scull.h"
+#include "splice_version.h"
+
+static int scull_snap_nr_devs = SCULL_SNAP_NR_DEVS; /* number of snapshots */
+static dev_t scull_snap_devno; /* first device number */
+
+module_param(scull_snap_nr_devs, int, 0);
+
+static struct scull_dev *scull_snap_devices;
+static unsigned long *scull_snap_busy; /* which ones hold a snapshot */
+static unsigned long *scull_snap_ready; /* ...that is completely filled */
+static unsigned long *scull_snap_dropped; /* ...that goes with the last close */
+static unsigned int *scull_snap_users; /* open files on each */
+static DEFINE_SPINLOCK(scull_snap_lock); /* for the four above */
+
+/*
+** Let go of a snapshot. Quanta the live device still has just lose a
+** reference; the others are freed.
+*/
+static void scull_snap_free(struct scull_dev *dev)
+{
+    int n = dev - scull_snap_devices;
+
+    down_write(&dev->rwsem);
+    scull_trim(dev);
+    up_write(&dev->rwsem);
+    spin_lock(&scull_snap_lock);
+    clear_bit(n, scull_snap_ready);
+    clear_bit(n, scull_snap_dropped);
+    clear_bit(n, scull_snap_busy);
+    spin_unlock(&scull_snap_lock);
+}
+
+static void scull_snap_put(struct scull_dev *dev)
+{
+    int n = dev - scull_snap_devices, last;
+
+    spin_lock(&scull_snap_lock);
+    last = !--scull_snap_users[n] && test_bit(n, scull_snap_dropped);
+    spin_unlock(&scull_snap_lock);
+    if (last)
+        scull_snap_free(dev);
+}
+
+static int scull_snap_open(struct inode *inode, struct file *filp)
+{
+    struct scull_dev *dev = container_of(inode->i_cdev, struct scull_dev, cdev);
+    int n = dev - scull_snap_devices, retval;
+
+    if (filp->f_mode & FMODE_WRITE)
+        return -EROFS;
+    spin_lock(&scull_snap_lock);
+    if (!test_bit(n, scull_snap_ready) || test_bit(n, scull_snap_dropped)) {
+        spin_unlock(&scull_snap_lock);
+        return -ENXIO;
+    }
+    scull_snap_users[n]++;
+    spin_unlock(&scull_snap_lock);
+
+    retval = scull_file_open(filp, dev);
+    if (retval)
+        scull_snap_put(dev);
+    return retval;
+}
+
+static int scull_snap_release(struct inode *inode, struct file *filp)
+{
+    struct scull_dev *dev = scull_file_dev(filp);
+
+    scull_release(inode, filp);
+    scull_snap_put(dev);
+    return 0;
+}
+
+/*
+** SCULL_IOCSNAPDROP comes through a file on the snapshot, so the memory
+** goes when that file, and any other still open, is closed. Meanwhile
+** the snapshot can't be opened again, nor its slot taken.
+*/
+static int scull_snap_drop(struct scull_dev *dev)
+{
+    int n = dev - scull_snap_devices;
+
+    spin_lock(&scull_snap_lock);
+    set_bit(n, scull_snap_dropped);
+    spin_unlock(&scull_snap_lock);
+    return 0;
+}
+
+/*
+** Snapshot "dev" into a free scullsnap device and return its number.
+** Writers to dev only wait for the metadata walk; filp is the file the
+** request came through, whose mappings have to fault again so that
+** writes through them copy the quanta. The busy bit claims the slot,
+** but it can only be opened once it is ready, after the walk is done.
+*/
+long scull_snap_take(struct file *filp, struct scull_dev *dev)
+{
+    struct scull_qset *sdptr, *ddptr;
+    struct scull_dev *snap;
+    unsigned long index;
+    void **out, *q;
+    long retval, held = 0;
+    int n, i, last;
+
+    if (!scull_snap_devices)
+        return -ENODEV;
+    do {
+        n = find_first_zero_bit(scull_snap_busy, scull_snap_nr_devs);
+        if (n >= scull_snap_nr_devs)
+            return -EBUSY;
+    } while (test_and_set_bit(n, scull_snap_busy));
+    snap = scull_snap_devices + n;
+
+    retval = scull_lock_for_change(dev, filp, 1);
+    if (retval) {
+        clear_bit(n, scull_snap_busy);
+        return retval;
+    }
+    down_write_nested(&snap->rwsem, SINGLE_DEPTH_NESTING);
+
+    unmap_mapping_range(filp->f_mapping, 0, 0, 1);
+
+    snap->quantum = dev->quantum;
+    snap->qset = dev->qset;
+    xa_for_each(dev->qsets, index, sdptr) {
+        if (!sdptr->data)
+            continue;
+        ddptr = scull_follow(snap, index);
+        if (!ddptr)
+            goto nomem;
+        for (i = 0; i < dev->qset; i++) {
+            if (!sdptr->data[i])
+                continue;
+            out = scull_get_slot(snap, ddptr, i);
+            if (!out)
+                goto nomem;
+            if (scull_q_is_packed(sdptr->data[i]) &&
+                !scull_unpack_locked(dev, &sdptr->data[i]))
+                goto nomem;
+            q = sdptr->data[i];
+            if (!scull_q_is_zero(q))
+                q = scull_share_quantum(dev->quantum, &sdptr->data[i]);
+            if (!q)
+                goto nomem;
+            *out = q;
+            if (scull_q_holds(q))
+                held++;
+        }
+    }
+    /* no new memory, but it is the snapshot's to account for as well */
+    atomic_long_set(&snap->stats.charged, held * dev->quantum);
+    snap->size = dev->size;
+    spin_lock(&scull_snap_lock);
+    set_bit(n, scull_snap_ready);
+    spin_unlock(&scull_snap_lock);
+    retval = n;
+    goto out;
+
+    nomem:
+        retval = -ENOMEM;
+        /* nobody can have it open yet, but leave it to the last close if so */
+        spin_lock(&scull_snap_lock);
+        last = !scull_snap_users[n];
+        if (!last)
+            set_bit(n, scull_snap_dropped);
+        spin_unlock(&scull_snap_lock);
+        if (!last)
+            goto out;
+        scull_trim(snap);
+        spin_lock(&scull_snap_lock);
+        clear_bit(n, scull_snap_busy);
+        spin_unlock(&scull_snap_lock);
+    out:
+        up_write(&snap->rwsem);
+        up_write(&dev->rwsem);
+        return retval;
+}
+
+static long scull_snap_ioctl(struct file *filp, unsigned int cmd,
+                             unsigned long arg)
+{
+    switch (cmd) {
+        case SCULL_IOCSNAPDROP:
+            if (!capable(CAP_SYS_ADMIN))
+                return -EPERM;
+            return scull_snap_drop(scull_file_dev(filp));
+    }
+
+    /* everything else is shared with the bare device */
+    return scull_ioctl(filp, cmd, arg);
+}
+
+/*
+** Snapshots can only be read; there is no mmap, since a shared mapping
+** can't be kept read-only here.
+*/
+static struct file_operations scull_snap_fops = {
+    .owner = THIS_MODULE,
+    .llseek = scull_llseek,
+    .read_iter = scull_read_iter,
+    .splice_read = compat_splice_read,
+    .unlocked_ioctl = scull_snap_ioctl,
+    .open = scull_snap_open,
+    .release = scull_snap_release,
+};
+
+static void scull_snap_setup_cdev(struct scull_dev *dev, int index)
+{
+    int err, devno = scull_snap_devno + index;
+
+    cdev_init(&dev->cdev, &scull_snap_fops);
+    dev->cdev.owner = THIS_MODULE;
+    err = cdev_add(&dev->cdev, devno, 1);
+    if (err)
+        printk(KERN_NOTICE "Error %d adding scullsnap%d", err, index);
+}
+
+int scull_snap_init(dev_t firstdev)
+{
+    int i, result;
+    char name[16];
+
+    if (scull_snap_nr_devs <= 0)
+        return 0;
+    result = register_chrdev_region(firstdev, scull_snap_nr_devs, "scullsnap");
+    if (result < 0) {
+        printk(KERN_NOTICE "Unable to get scullsnap region, error %d\n", result);
+        return 0;
+    }
+    scull_snap_devno = firstdev;
+    scull_snap_devices = kcalloc(scull_snap_nr_devs, sizeof(struct scull_dev),
+                                 GFP_KERNEL);
+    scull_snap_busy = bitmap_zalloc(scull_snap_nr_devs, GFP_KERNEL);
+    scull_snap_ready = bitmap_zalloc(scull_snap_nr_devs, GFP_KERNEL);
+    scull_snap_dropped = bitmap_zalloc(scull_snap_nr_devs, GFP_KERNEL);
+    scull_snap_users = kcalloc(scull_snap_nr_devs, sizeof(*scull_snap_users),
+                               GFP_KERNEL);
+    if (!scull_snap_devices || !scull_snap_busy || !scull_snap_ready ||
+        !scull_snap_dropped || !scull_snap_users)
+        goto fail;
+
+    for (i = 0; i < scull_snap_nr_devs; i++) {
+        snprintf(name, sizeof(name), "scullsnap%d", i);
+        scull_snap_devices[i].qsets = scull_qsets_alloc();
+        if (!scull_snap_devices[i].qsets ||
+            scull_stats_init(&scull_snap_devices[i].stats, name)) {
+            scull_qsets_free(scull_snap_devices + i);
+            while (--i >= 0) {
+                scull_stats_cleanup(&scull_snap_devices[i].stats);
+                scull_qsets_free(scull_snap_devices + i);
+            }
+            goto fail;
+        }
+    }
+
+    for (i = 0; i < scull_snap_nr_devs; i++) {
+        scull_snap_devices[i].quantum = scull_quantum;
+        scull_snap_devices[i].qset = scull_qset;
+        init_rwsem(&scull_snap_devices[i].rwsem);
+        scull_snap_setup_cdev(scull_snap_devices + i, i);
+    }
+    return scull_snap_nr_devs;
+
+    fail:
+        bitmap_free(scull_snap_busy);
+        bitmap_free(scull_snap_ready);
+        bitmap_free(scull_snap_dropped);
+        kfree(scull_snap_users);
+        kfree(scull_snap_devices);
+        scull_snap_busy = NULL;
+        scull_snap_ready = NULL;
+        scull_snap_dropped = NULL;
+        scull_snap_users = NULL;
+        scull_snap_devices = NULL;
+        unregister_chrdev_region(firstdev, scull_snap_nr_devs);
+        return 0;
+}
+
+void scull_snap_cleanup(void)
+{
+    int i;
+
+    if (!scull_snap_devices)
+        return;
+
+    for (i = 0; i < scull_snap_nr_devs; i++) {
+        cdev_del(&scull_snap_devices[i].cdev);
+        scull_qsets_free(scull_snap_devices + i);
+        scull_stats_cleanup(&scull_snap_devices[i].stats);
+    }
+    bitmap_free(scull_snap_busy);
+    bitmap_free(scull_snap_ready);
+    bitmap_free(scull_snap_dropped);
+    kfree(scull_snap_users);
+    kfree(scull_snap_devices);
+    unregister_chrdev_region(scull_snap_devno, scull_snap_nr_devs);
+    scull_snap_busy = NULL;
+    scull_snap_ready = NULL;
+    scull_snap_dropped = NULL;
+    scull_snap_users = NULL;
+    scull_snap_devices = NULL;
+}
@@ -0,0 +1,145 @@
+/*
+ * stats.c -- per-CPU statistics for the scull devices
+ *
+ * Every device keeps its counters in a per-CPU structure, so the hot
+ * paths only ever touch cache lines of their own CPU. The counters are
+ * summed when the debugfs file is read:
+ *
+ *   /sys/kernel/debug/scull/<device>
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "scull.h"
+
+static struct dentry *scull_debugfs_root;
+
+static void scull_print_hist(struct seq_file *s, const char *name, u64 *hist)
+{
+    int i;
+
+    seq_printf(s, "%s:\n", name);
+    for (i = 0; i < SCULL_LAT_BUCKETS; i++) {
+        if (!hist[i])
+            continue;
+        if (i == SCULL_LAT_BUCKETS - 1)
+            seq_printf(s, "  >= %llu ns: %llu\n", 1ULL << i, hist[i]);
+        else
+            seq_printf(s, "  < %llu ns: %llu\n", 1ULL << (i + 1), hist[i]);
+    }
+}
+
+/* sizes are bucketed by log2 rounded up, so that 2^n falls in bucket n */
+static void scull_print_sizes(struct seq_file *s, const char *name, u64 *hist)
+{
+    int i;
+
+    seq_printf(s, "%s:\n", name);
+    for (i = 0; i < SCULL_LAT_BUCKETS; i++) {
+        if (!hist[i])
+            continue;
+        if (i == SCULL_LAT_BUCKETS - 1)
+            seq_printf(s, "  > %llu bytes: %llu\n", 1ULL << (i - 1), hist[i]);
+        else
+            seq_printf(s, "  <= %llu bytes: %llu\n", 1ULL << i, hist[i]);
+    }
+}
+
+static int scull_stats_show(struct seq_file *s, void *v)
+{
+    struct scull_stats *st = s->private;
+    struct scull_stats_cpu *sum;
+    struct scull_stats_cpu *c;
+    int cpu, i;
+
+    sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu) {
+        c = per_cpu_ptr(st->cpu, cpu);
+        sum->reads += c->reads;
+        sum->writes += c->writes;
+        sum->bytes_read += c->bytes_read;
+        sum->bytes_written += c->bytes_written;
+        sum->lock_wait_ns += c->lock_wait_ns;
+        sum->sleeps += c->sleeps;
+        sum->alloc_failures += c->alloc_failures;
+        sum->pool_hits += c->pool_hits;
+        sum->pool_misses += c->pool_misses;
+        sum->dedup_zero += c->dedup_zero;
+        sum->dedup_hits += c->dedup_hits;
+        sum->dedup_saved += c->dedup_saved;
+        sum->seq_writes += c->seq_writes;
+        sum->folios += c->folios;
+        sum->folio_fallbacks += c->folio_fallbacks;
+        for (i = 0; i < SCULL_LAT_BUCKETS; i++) {
+            sum->read_lat[i] += c->read_lat[i];
+            sum->write_lat[i] += c->write_lat[i];
+            sum->write_size[i] += c->write_size[i];
+        }
+    }
+
+    seq_printf(s, "reads: %llu\n", sum->reads);
+    seq_printf(s, "writes: %llu\n", sum->writes);
+    seq_printf(s, "bytes_read: %llu\n", sum->bytes_read);
+    seq_printf(s, "bytes_written: %llu\n", sum->bytes_written);
+    seq_printf(s, "lock_wait_ns: %llu\n", sum->lock_wait_ns);
+    seq_printf(s, "sleeps: %llu\n", sum->sleeps);
+    seq_printf(s, "alloc_failures: %llu\n", sum->alloc_failures);
+    seq_printf(s, "pool_hits: %llu\n", sum->pool_hits);
+    seq_printf(s, "pool_misses: %llu\n", sum->pool_misses);
+    seq_printf(s, "packed_raw: %ld\n", atomic_long_read(&st->packed_raw));
+    seq_printf(s, "packed_bytes: %ld\n", atomic_long_read(&st->packed_bytes));
+    seq_printf(s, "charged: %ld\n", atomic_long_read(&st->charged));
+    seq_printf(s, "dedup_zero: %llu\n", sum->dedup_zero);
+    seq_printf(s, "dedup_hits: %llu\n", sum->dedup_hits);
+    seq_printf(s, "dedup_saved: %llu\n", sum->dedup_saved);
+    seq_printf(s, "seq_writes: %llu\n", sum->seq_writes);
+    seq_printf(s, "folios: %llu\n", sum->folios);
+    seq_printf(s, "folio_fallbacks: %llu\n", sum->folio_fallbacks);
+    if (st->show)
+        st->show(s, st);
+    scull_print_hist(s, "read_latency", sum->read_lat);
+    scull_print_hist(s, "write_latency", sum->write_lat);
+    scull_print_sizes(s, "write_size", sum->write_size);
+
+    kfree(sum);
+    return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(scull_stats);
+
+int scull_stats_init(struct scull_stats *st, const char *name)
+{
+    st->cpu = alloc_percpu(struct scull_stats_cpu);
+    if (!st->cpu)
+        return -ENOMEM;
+    st->dentry = debugfs_create_file(name, 0444, scull_debugfs_root, st,
+                                     &scull_stats_fops);
+    return 0;
+}
+
+void scull_stats_cleanup(struct scull_stats *st)
+{
+    debugfs_remove(st->dentry);
+    st->dentry = NULL;
+    free_percpu(st->cpu);
+    st->cpu = NULL;
+}
+
+void scull_stats_root_init(void)
+{
+    scull_debugfs_root = debugfs_create_dir("scull", NULL);
+}
+
+void scull_stats_root_cleanup(void)
+{
+    debugfs_remove_recursive(scull_debugfs_root);
+    scull_debugfs_root = NULL;
+}